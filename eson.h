@@ -29,11 +29,27 @@ SOFTWARE.
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include <map>
 #include <string>
 #include <vector>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+// volatile access has acquire/release semantics on MSVC.
+#define ESON_ATOMIC_LOAD(p) (*(p))
+#define ESON_ATOMIC_STORE(p, v) (*(p) = (v))
+#define ESON_ATOMIC_INC(p) _InterlockedIncrement(p)
+#define ESON_ATOMIC_DEC(p) _InterlockedDecrement(p)
+#else
+#define ESON_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ESON_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+// Returns the new value.
+#define ESON_ATOMIC_INC(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define ESON_ATOMIC_DEC(p) __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#endif
+
 namespace eson {
 
 typedef enum {
@@ -44,15 +60,232 @@ typedef enum {
   STRING_TYPE = 4,
   ARRAY_TYPE = 5,
   BINARY_TYPE = 6,
-  OBJECT_TYPE = 7
+  OBJECT_TYPE = 7,
+
+  // Element tags which only appear in serialized data.
+  BINARY_CRC32C_TYPE = 8,  // Binary with CRC32C checksum per block
+  CRC32C_TYPE = 9,         // CRC32C checksum of the enclosing object
+  COLUMNS_TYPE = 10,       // Array of same-schema objects stored by column
+  BINARY_REF_TYPE = 11     // Binary with the payload of an earlier binary
 } Type;
 
+/// Wire encoding.
+typedef enum {
+  // Lengths and integers are fixed 64-bit values.
+  ENCODING_FIXED = 0,
+
+  // Lengths and integers are LEB128 varints(integers are zigzag encoded).
+  // Marked in the document header, so `Parse` detects it.
+  ENCODING_COMPACT = 1
+} Encoding;
+
+struct SerializeOption {
+  Encoding encoding;
+
+  // Write a binary whose payload is identical to an earlier one as a
+  // reference to that payload. Binaries smaller than kMinDedupSize, binaries
+  // with checksums and binaries in columns are always written in full.
+  bool dedup_binary;
+  char pad3_[3];
+
+  SerializeOption() : encoding(ENCODING_FIXED), dedup_binary(false) {}
+};
+
+/// Smallest binary which is deduplicated. A reference takes 16 bytes.
+const uint64_t kMinDedupSize = 64;
+
+/// Default block size of checksummed binary.
+const uint64_t kChecksumBlockSize = 1024 * 1024;
+
+/// Update CRC32C(Castagnoli) `crc` with `n` bytes of `p`.
+/// Start with crc = 0. Uses SSE4.2 instruction if the CPU supports it.
+uint32_t CRC32C(uint32_t crc, const uint8_t *p, uint64_t n);
+
+struct SerializeState;  // Internal
+struct ParseState;      // Internal
+
+/// Reference counted handle to memory which backs binary data(e.g. a heap
+/// buffer or a file mapping). The memory is released when the last handle is
+/// destroyed, so values holding a handle stay valid after the loader or the
+/// input buffer is gone.
+class Buffer {
+ public:
+  /// Called with the `ctx`, data and size given to `Wrap`.
+  typedef void (*ReleaseFunc)(void *ctx, uint8_t *data, uint64_t size);
+
+  Buffer() : block_(NULL) {}
+  Buffer(const Buffer &other) : block_(other.block_) {
+    if (block_) ESON_ATOMIC_INC(&block_->refcount);
+  }
+  ~Buffer() { Release(); }
+
+  Buffer &operator=(const Buffer &other) {
+    if (other.block_) ESON_ATOMIC_INC(&other.block_->refcount);
+    Release();
+    block_ = other.block_;
+    return (*this);
+  }
+
+  /// Allocate `n` bytes(uninitialized) on heap.
+  static Buffer Allocate(uint64_t n);
+
+  /// Copy `n` bytes of `p` into a new heap buffer.
+  static Buffer Copy(const uint8_t *p, uint64_t n);
+
+  /// Take ownership of `data`. `release` is called when the last handle is
+  /// destroyed. `release` may be NULL for memory which outlives all handles.
+  static Buffer Wrap(uint8_t *data, uint64_t n, ReleaseFunc release,
+                     void *ctx);
+
+  const uint8_t *Data() const { return block_ ? block_->data : NULL; }
+  uint8_t *Data() { return block_ ? block_->data : NULL; }
+  uint64_t Size() const { return block_ ? block_->size : 0; }
+  bool Empty() const { return (block_ == NULL); }
+
+  /// Check if [p, p + n) is in this buffer.
+  bool Contains(const uint8_t *p, uint64_t n) const {
+    return block_ && (p >= block_->data) &&
+           (static_cast<uint64_t>(p - block_->data) <= block_->size) &&
+           (n <= block_->size - static_cast<uint64_t>(p - block_->data));
+  }
+
+  /// Number of handles sharing the memory(for diagnostics).
+  long UseCount() const {
+    return block_ ? ESON_ATOMIC_LOAD(&block_->refcount) : 0;
+  }
+
+ private:
+  struct Block {
+    uint8_t *data;
+    uint64_t size;
+    ReleaseFunc release;
+    void *ctx;
+    long refcount;
+  };
+
+  void Release() {
+    if (block_ && (ESON_ATOMIC_DEC(&block_->refcount) == 0)) {
+      Destroy(block_);
+    }
+    block_ = NULL;
+  }
+
+  static void Destroy(Block *block);
+
+  Block *block_;
+};
+
+/// Reference counted copy-on-write storage. Copies share the data, and
+/// `Mutable` makes a private copy only if it is shared.
+/// Data which has been handed out by `Mutable` may still be modified through
+/// that reference, so it is no longer shared: later copies copy the data.
+template <typename T>
+class Shared {
+ public:
+  Shared() : holder_(NULL) {}
+  explicit Shared(const T &v) : holder_(new Holder(v)) {}
+  Shared(const Shared &other) : holder_(Acquire(other.holder_)) {}
+  ~Shared() { Release(); }
+
+  Shared &operator=(const Shared &other) {
+    Holder *holder = Acquire(other.holder_);
+    Release();
+    holder_ = holder;
+    return (*this);
+  }
+
+  const T &Get() const { return holder_ ? holder_->value : Empty(); }
+  const T &operator*() const { return Get(); }
+  const T *operator->() const { return &Get(); }
+
+  /// Writable reference. Copies the data first if it is shared.
+  T &Mutable() {
+    if (!holder_) {
+      holder_ = new Holder(T());
+    } else if (ESON_ATOMIC_LOAD(&holder_->refcount) > 1) {
+      Holder *copy = new Holder(holder_->value);
+      Release();
+      holder_ = copy;
+    }
+    holder_->shareable = false;
+    return holder_->value;
+  }
+
+ private:
+  struct Holder {
+    explicit Holder(const T &v) : value(v), refcount(1), shareable(true) {}
+    T value;
+    long refcount;
+    bool shareable;
+    char pad7_[7];
+  };
+
+  static Holder *Acquire(Holder *holder) {
+    if (!holder) return NULL;
+    if (!holder->shareable) return new Holder(holder->value);
+    ESON_ATOMIC_INC(&holder->refcount);
+    return holder;
+  }
+
+  void Release() {
+    if (holder_ && (ESON_ATOMIC_DEC(&holder_->refcount) == 0)) {
+      delete holder_;
+    }
+    holder_ = NULL;
+  }
+
+  static const T &Empty() {
+    static const T &empty = *(new T());
+    return empty;
+  }
+
+  Holder *holder_;
+};
+
 class Value {
  public:
-  typedef struct {
+  struct Binary {
+    Binary() : ptr(NULL), size(0) {}
+
     const uint8_t *ptr;
     int64_t size;
-  } Binary;
+    Buffer buffer;  // Keeps `ptr` alive if set.
+  };
+
+  /// Column of a columnar array(see `SetColumnar`). Points into the parsed
+  /// data. Values are not aligned, so read them through the accessors.
+  struct Column {
+    Column() : type(NULL_TYPE), rows(0), data(NULL), offsets(NULL) {}
+
+    char type;  // BOOL, INT64, FLOAT64, STRING or BINARY
+    char pad7_[7];
+    uint64_t rows;
+    // Bool: 1 byte per row. Int64 and float64: 8 bytes per row.
+    // String and binary: bytes of all rows.
+    const uint8_t *data;
+    const uint8_t *offsets;  // String and binary: rows + 1 int64 offsets
+    Buffer buffer;           // Keeps `data` alive if set.
+
+    bool Bool(uint64_t i) const { return (data[i] != 0); }
+    int64_t Int64(uint64_t i) const {
+      int64_t v;
+      memcpy(&v, data + i * sizeof(int64_t), sizeof(int64_t));
+      return v;
+    }
+    double Float64(uint64_t i) const {
+      double v;
+      memcpy(&v, data + i * sizeof(double), sizeof(double));
+      return v;
+    }
+    /// String or binary of row `i`. Its size is set to `n`.
+    const uint8_t *Bytes(uint64_t i, uint64_t &n) const {
+      uint64_t begin, end;
+      memcpy(&begin, offsets + i * sizeof(int64_t), sizeof(int64_t));
+      memcpy(&end, offsets + (i + 1) * sizeof(int64_t), sizeof(int64_t));
+      n = end - begin;
+      return data + begin;
+    }
+  };
 
   typedef std::vector<Value> Array;
   typedef std::map<std::string, Value> Object;
@@ -65,73 +298,231 @@ class Value {
 
   // union {
   bool boolean_;
-  char pad6_[6];
+  bool checksum_;  // Emit checksum when serialized.
+  bool modified_;  // Possibly modified after parsing.
+  bool source_compact_;       // Source is compact encoding.
+  bool source_uncopyable_;    // Source has checksums or binary references.
+  bool columnar_;             // Array is serialized by column.
+  mutable bool rows_pending_;  // Rows of `columns_` are not decoded yet.
   int64_t int64_;
   double float64_;
-  std::string string_;
+  Shared<std::string> string_;
   Binary binary_;
-  Array array_;
-  Object object_;
+  uint64_t checksum_block_size_;   // Binary only
+  const uint8_t *checksum_table_;  // CRC32C per block of parsed binary
+  const uint8_t *source_ptr_;      // Serialized bytes this was parsed from
+  uint64_t source_size_;
+  Buffer source_buffer_;           // Keeps `source_ptr_` alive if set.
+  const uint8_t *columns_;         // Parsed columnar array(after its size)
+  const uint8_t *columns_end_;
+  mutable Shared<Array> array_;
+  Shared<Object> object_;
   //};
 
  public:
-  Value() : type_(NULL_TYPE), dirty_(true) {}
+  Value()
+      : type_(NULL_TYPE),
+        size_(0),
+        dirty_(false),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {}
 
-  explicit Value(bool b) : type_(BOOL_TYPE), dirty_(false) {
+  explicit Value(bool b)
+      : type_(BOOL_TYPE),
+        dirty_(false),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {
     boolean_ = b;
     size_ = 1;
   }
-  explicit Value(int64_t i) : type_(INT64_TYPE), dirty_(false) {
+  explicit Value(int64_t i)
+      : type_(INT64_TYPE),
+        dirty_(false),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {
     int64_ = i;
     size_ = 8;
   }
-  explicit Value(double n) : type_(FLOAT64_TYPE), dirty_(false) {
+  explicit Value(double n)
+      : type_(FLOAT64_TYPE),
+        dirty_(false),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {
     float64_ = n;
     size_ = 8;
   }
-  explicit Value(const std::string &s) : type_(STRING_TYPE), dirty_(false) {
-    string_ = std::string(s);
-    size_ = string_.size();
+  explicit Value(const std::string &s)
+      : type_(STRING_TYPE),
+        dirty_(false),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {
+    string_ = Shared<std::string>(s);
+    size_ = string_->size();
   }
   explicit Value(const uint8_t *p, uint64_t n)
-      : type_(BINARY_TYPE), dirty_(false) {
+      : type_(BINARY_TYPE),
+        dirty_(false),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {
     binary_ = Binary();
     binary_.ptr = p;  // Just save a pointer.
     binary_.size = static_cast<int64_t>(n);
     size_ = n;
   }
-  explicit Value(const Array &a) : type_(ARRAY_TYPE), dirty_(true) {
-    array_ = Array(a);
+  /// Binary pointing into `buffer`, which is kept alive by this value.
+  explicit Value(const uint8_t *p, uint64_t n, const Buffer &buffer)
+      : type_(BINARY_TYPE),
+        dirty_(false),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {
+    assert(buffer.Empty() || buffer.Contains(p, n));
+    binary_ = Binary();
+    binary_.ptr = p;
+    binary_.size = static_cast<int64_t>(n);
+    binary_.buffer = buffer;
+    size_ = n;
+  }
+  /// Binary of whole `buffer`.
+  explicit Value(const Buffer &buffer)
+      : type_(BINARY_TYPE),
+        dirty_(false),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {
+    binary_ = Binary();
+    binary_.ptr = buffer.Data();
+    binary_.size = static_cast<int64_t>(buffer.Size());
+    binary_.buffer = buffer;
+    size_ = buffer.Size();
+  }
+  explicit Value(const Array &a)
+      : type_(ARRAY_TYPE),
+        dirty_(true),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {
+    array_ = Shared<Array>(a);
     size_ = ComputeArraySize();
   }
-  explicit Value(const Object &o) : type_(OBJECT_TYPE), dirty_(true) {
-    object_ = Object(o);
+  explicit Value(const Object &o)
+      : type_(OBJECT_TYPE),
+        dirty_(true),
+        checksum_(false),
+        modified_(false),
+        source_compact_(false),
+        source_uncopyable_(false),
+        columnar_(false),
+        rows_pending_(false),
+        checksum_block_size_(0),
+        checksum_table_(NULL),
+        source_ptr_(NULL),
+        source_size_(0),
+        columns_(NULL),
+        columns_end_(NULL) {
+    object_ = Shared<Object>(o);
     size_ = ComputeObjectSize();
   }
   //~Value() {}
 
-  /// Compute size of array element.
+  /// Compute array size. Elements may have different types.
   uint64_t ComputeArraySize() const {
     assert(type_ == ARRAY_TYPE);
-
-    assert(array_.size() > 0);
-
-    char base_element_type = array_[0].Type();
-
-    //
-    // Elements in the array must be all same type.
-    //
+    LoadRows();
 
     uint64_t sum = 0;
-    for (size_t i = 0; i < array_.size(); i++) {
-      char element_type = array_[i].Type();
-      assert(base_element_type == element_type);
-      (void)element_type;
-      sum += array_[i].ComputeSize();
+    for (size_t i = 0; i < array_->size(); i++) {
+      sum += (*array_)[i].ComputeSize() + 1;  // +1 = tag size.
     }
-    (void)base_element_type;
 
-    return sum + 1 + sizeof(int64_t);
+    return sum;
   }
 
   /// Compute object size.
@@ -140,7 +531,7 @@ class Value {
 
     uint64_t object_size = 0;
 
-    for (Object::const_iterator it = object_.begin(); it != object_.end();
+    for (Object::const_iterator it = object_->begin(); it != object_->end();
          ++it) {
       const std::string &key = it->first;
       uint64_t key_len = key.length() + 1;  // + '\0'
@@ -148,12 +539,26 @@ class Value {
       object_size += key_len + data_len + 1;  // +1 = tag size.
     }
 
+    if (checksum_) {
+      object_size += 1 + 1 + sizeof(uint32_t);  // tag + "" + crc
+    }
+
     return object_size;
   }
 
   /// Compute data size.
   uint64_t ComputeSize() const {
+    if (CanReuseSource(false)) {
+      return source_size_;
+    }
+
     switch (type_) {
+      case NULL_TYPE:
+        return 0;
+        break;
+      case BOOL_TYPE:
+        return 1;
+        break;
       case INT64_TYPE:
         return 8;
         break;
@@ -161,12 +566,23 @@ class Value {
         return 8;
         break;
       case STRING_TYPE:
-        return string_.size() + sizeof(int64_t);  // N + str data
+        return string_->size() + sizeof(int64_t);  // N + str data
         break;
       case BINARY_TYPE:
+        if (checksum_) {
+          // N + block size + checksums + bin data
+          return size_ + 2 * sizeof(int64_t) +
+                 NumChecksumBlocks() * sizeof(uint32_t);
+        }
         return size_ + sizeof(int64_t);  // N + bin data
         break;
       case ARRAY_TYPE:
+        if (columnar_) {
+          uint64_t columns_size = ComputeColumnsSize();
+          if (columns_size > 0) {
+            return columns_size + sizeof(int64_t);  // datalen + N
+          }
+        }
         return ComputeArraySize() + sizeof(int64_t);  // datalen + N
         break;
       case OBJECT_TYPE:
@@ -180,6 +596,8 @@ class Value {
     return 0;  // Never come here.
   }
 
+  /// Serialized size. Cached, so the first call after a modification writes
+  /// the cache even though this is const(see `Freeze`).
   uint64_t Size() const {
     if (!dirty_) {
       return size_;
@@ -191,6 +609,17 @@ class Value {
     }
   }
 
+  /// Serialized size with the given option.
+  uint64_t Size(const SerializeOption &option) const;
+
+  /// Finalize cached sizes of this value and all of its descendants.
+  /// Afterwards const member functions(`Get`, `Size`, `Serialize`, ...) of the
+  /// subtree don't write anything, so it can be read from many threads
+  /// without locks while nobody calls non-const functions on it. Copies are
+  /// safe to modify from any thread, since modification copies shared data
+  /// first.
+  void Freeze() const;
+
   char Type() const { return static_cast<const char>(type_); }
 
   bool IsBool() const { return (type_ == BOOL_TYPE); }
@@ -215,32 +644,36 @@ class Value {
 
   // Lookup value from an array
   const Value &Get(int64_t idx) const {
-    static Value &null_value = *(new Value());
     assert(IsArray());
     assert(idx >= 0);
-    return (static_cast<uint64_t>(idx) < array_.size())
-               ? array_[static_cast<uint64_t>(idx)]
-               : null_value;
+    LoadRows();
+    return (static_cast<uint64_t>(idx) < array_->size())
+               ? (*array_)[static_cast<uint64_t>(idx)]
+               : NullValue();
   }
 
   // Lookup value from a key-value pair
   const Value &Get(const std::string &key) const {
-    static Value &null_value = *(new Value());
     assert(IsObject());
-    Object::const_iterator it = object_.find(key);
-    return (it != object_.end()) ? it->second : null_value;
+    Object::const_iterator it = object_->find(key);
+    return (it != object_->end()) ? it->second : NullValue();
   }
 
   size_t ArrayLen() const {
     if (!IsArray()) return 0;
-    return array_.size();
+    if (rows_pending_) {
+      int64_t rows;  // Stored first. No need to decode rows.
+      memcpy(&rows, columns_, sizeof(int64_t));
+      return static_cast<size_t>(rows);
+    }
+    return array_->size();
   }
 
   // Valid only for object type.
   bool Has(const std::string &key) const {
     if (!IsObject()) return false;
-    Object::const_iterator it = object_.find(key);
-    return (it != object_.end()) ? true : false;
+    Object::const_iterator it = object_->find(key);
+    return (it != object_->end()) ? true : false;
   }
 
   // List keys
@@ -248,7 +681,7 @@ class Value {
     std::vector<std::string> keys;
     if (!IsObject()) return keys;  // empty
 
-    for (Object::const_iterator it = object_.begin(); it != object_.end();
+    for (Object::const_iterator it = object_->begin(); it != object_->end();
          ++it) {
       keys.push_back(it->first);
     }
@@ -256,397 +689,4940 @@ class Value {
     return keys;
   }
 
+  /// Store CRC32C checksums when serialized. Valid for binary and object.
+  /// Binary has one checksum per `block_size` bytes so that a ranged read
+  /// only needs to verify blocks it touches. Object has one checksum which
+  /// covers all of its bytes except payloads of checksummed binaries.
+  void EnableChecksum(uint64_t block_size = kChecksumBlockSize) {
+    assert(IsBinary() || IsObject());
+    assert(block_size > 0);
+    checksum_ = true;
+    checksum_block_size_ = block_size;
+    modified_ = true;
+    if (IsObject()) dirty_ = true;
+  }
+
+  void DisableChecksum() {
+    checksum_ = false;
+    checksum_block_size_ = 0;
+    checksum_table_ = NULL;
+    modified_ = true;
+    if (IsObject()) dirty_ = true;
+  }
+
+  bool HasChecksum() const { return checksum_; }
+
+  /// Serialize this array by column: the keys and types once, then the
+  /// values of each key packed together. Applies when all elements are
+  /// objects with the same keys and value types(bool, int64, float64, string
+  /// or binary without checksum). Otherwise the array is serialized as usual.
+  /// Parsed columnar arrays stay columnar. Their rows are decoded on first
+  /// access(or by `Freeze`), and `GetColumn` reads a column without decoding.
+  void SetColumnar(bool columnar) {
+    assert(IsArray());
+    if (columnar_ == columnar) return;
+    columnar_ = columnar;
+    modified_ = true;
+    dirty_ = true;
+  }
+
+  bool IsColumnar() const { return columnar_; }
+
+  /// Zero-copy view of the column `key` of a columnar array parsed from data.
+  /// Only bytes of the column are read. Returns false if this is not an
+  /// unmodified parsed columnar array, or it has no such column.
+  bool GetColumn(const std::string &key, Column &column) const;
+
+  /// Verify stored checksums of the blocks which overlap
+  /// [offset, offset + len) of parsed binary data.
+  /// Returns true when there is no stored checksum.
+  bool VerifyChecksum(uint64_t offset, uint64_t len) const;
+
+  /// True unless this value was parsed and has not been accessed through
+  /// non-const `Get<T>()` since. Since children are only reachable for
+  /// modification through non-const `Get<Object>()`/`Get<Array>()` of their
+  /// parent, a modification marks the whole path from the root.
+  /// Unmodified objects are serialized by copying their source bytes, so
+  /// re-saving after a small edit only re-encodes the edited path.
+  bool IsModified() const { return modified_ || !source_ptr_; }
+
   // Serialize data to memory 'p'.
   // Memory of 'p' must be allocated by app before calling this function.
   // (size can be obtained by calling 'Size' function.
   // Return next data location.
   uint8_t *Serialize(uint8_t *p) const;
+  uint8_t *Serialize(uint8_t *p, const SerializeOption &option) const;
 
  private:
+  // Source bytes can be copied as is.
+  bool CanReuseSource(bool compact) const {
+    return source_ptr_ && !modified_ && !source_uncopyable_ &&
+           (source_compact_ == compact);
+  }
 
-  static Value null_value();
+  uint64_t NumChecksumBlocks() const {
+    return (size_ + checksum_block_size_ - 1) / checksum_block_size_;
+  }
+
+  // Element tag in serialized data.
+  char Tag() const {
+    if (checksum_ && IsBinary()) return BINARY_CRC32C_TYPE;
+    if (columnar_ && IsArray() &&
+        ((columns_ && !modified_) || (ComputeColumnsSize() > 0))) {
+      return COLUMNS_TYPE;
+    }
+    return Type();
+  }
+
+  // Decode rows of a parsed columnar array on first access.
+  void LoadRows() const {
+    if (rows_pending_) DecodeRows();
+  }
+  void DecodeRows() const;
+
+  /// Content size of the columnar encoding(same in both encodings), or 0 if
+  /// elements don't share a schema.
+  uint64_t ComputeColumnsSize() const;
+  uint8_t *SerializeColumns(uint8_t *p, SerializeState &state) const;
+
+  /// Compute size in the compact encoding or with deduplication. Content
+  /// sizes of objects and arrays are appended to `state.sizes`, and
+  /// duplicates to `state.binary_refs`, in the order they are serialized.
+  uint64_t ComputeEncodedSize(SerializeState &state, bool root) const;
+
+  uint8_t *Serialize(uint8_t *p, SerializeState &state) const;
+
+  friend struct ParseState;
+  friend struct SerializeState;
+
+  static const Value &NullValue() {
+    static const Value &null_value = *(new Value());
+    return null_value;
+  }
 };
 
 // Alias
 typedef Value::Array Array;
 typedef Value::Object Object;
 typedef Value::Binary Binary;
+typedef Value::Column Column;
 
-#define GET(ctype, var)                           \
-  template <>                                     \
-  inline const ctype &Value::Get<ctype>() const { \
-    return var;                                   \
-  }                                               \
-  template <>                                     \
-  inline ctype &Value::Get<ctype>() {             \
-    return var;                                   \
-  }
-GET(bool, boolean_)
-GET(double, float64_)
-GET(int64_t, int64_)
-GET(std::string, string_)
-GET(Binary, binary_)
-GET(Array, array_)
-GET(Object, object_)
+// Non-const access marks the value as modified. Containers also drop the
+// cached size since their elements may change.
+// Strings, arrays and objects are shared between copies of a Value until
+// modified through non-const access.
+#define GET(ctype, var, mutable_var, invalidate_size) \
+  template <>                                         \
+  inline const ctype &Value::Get<ctype>() const {     \
+    return var;                                       \
+  }                                                   \
+  template <>                                         \
+  inline ctype &Value::Get<ctype>() {                 \
+    modified_ = true;                                 \
+    if (invalidate_size) dirty_ = true;               \
+    return mutable_var;                               \
+  }
+GET(bool, boolean_, boolean_, false)
+GET(double, float64_, float64_, false)
+GET(int64_t, int64_, int64_, false)
+GET(std::string, *string_, string_.Mutable(), false)
+GET(Binary, binary_, binary_, false)
+GET(Object, *object_, object_.Mutable(), true)
 #undef GET
 
-// Deserialize data from memory 'p'.
-// Returns error string. Empty if success.
-std::string Parse(Value &v, const uint8_t *p);
-std::string Parse(Array &v, const uint8_t *p);
+// Rows of a parsed columnar array are decoded first.
+template <>
+inline const Array &Value::Get<Array>() const {
+  LoadRows();
+  return *array_;
+}
+template <>
+inline Array &Value::Get<Array>() {
+  LoadRows();
+  modified_ = true;
+  dirty_ = true;
+  return array_.Mutable();
+}
 
-class ESON {
- public:
-  ESON();
-  ~ESON();
+struct ParseOption {
+  // Verify checksums of checksummed objects.
+  bool verify_object_checksum;
 
-  /// Load data from a file.
-  bool Load(const char *filename);
+  // Remember the source bytes of parsed objects and arrays, so that
+  // unmodified ones are copied as is when re-serialized. The data must not
+  // change until then. Implied by `buffer`, which keeps the data alive.
+  bool keep_source;
 
-  /// Dump data to a file.
-  bool Dump(const char *filename);
+  // Verify all blocks of checksummed binaries while parsing. Off by default:
+  // this reads every payload(faulting in a whole mapped file), so blocks are
+  // verified with `Value::VerifyChecksum(offset, len)` as they are read.
+  bool verify_binary_checksum;
 
- private:
-  uint8_t *data_;  /// Pointer to data
-  uint64_t size_;  /// Total data size
+  char pad5_[5];
 
-  bool valid_;
-};
+  // Memory holding the serialized data. If set, parsed binaries and source
+  // bytes of objects keep it alive, so the values may outlive the caller's
+  // reference to it.
+  Buffer buffer;
 
-}  // namespace eson
+  ParseOption()
+      : verify_object_checksum(true),
+        keep_source(false),
+        verify_binary_checksum(false) {}
+};
 
-#ifdef ESON_IMPLEMENTATION
-#include <cassert>
-#include <cstdio>
-#include <cstdlib>
-#include <cstring>
-#include <sstream>
+// Deserialize data from memory 'p'.
+// Parsed binaries and columns point into 'p', so 'p' must outlive them.
+// Objects and arrays are re-encoded when serialized; set
+// `ParseOption::keep_source` to copy unmodified ones from 'p' instead.
+// Returns error string. Empty if success.
+std::string Parse(Value &v, const uint8_t *p);
 
-#ifdef _WIN32
-#if defined(__MINGW32__)
-#include <windows.h>  //  File mapping
-#else
-#include <Windows.h>
-#endif
-#else
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#endif
+// Deserialize an array written by `Value(array).Serialize()`.
+std::string Parse(Array &v, const uint8_t *p);
 
-namespace eson {
+// Deserialize data from memory 'p' of `size` bytes.
+// Length fields are checked against `size` and enclosing elements.
+std::string Parse(Value &v, const uint8_t *p, uint64_t size,
+                  const ParseOption &option);
 
-uint8_t *Value::Serialize(uint8_t *p) const {
-  uint8_t *ptr = p;
-  switch (type_) {
-    case FLOAT64_TYPE:
-      memcpy(ptr, &float64_, sizeof(double));
-      ptr += sizeof(double);
-      break;
-    case INT64_TYPE: {
-      // (*(reinterpret_cast<int64_t *>(ptr))) = int64_;
-      memcpy(ptr, &int64_, sizeof(int64_t));
-      ptr += sizeof(int64_t);
-    } break;
-    case STRING_TYPE: {
-      // len(64bit) + string
-      // (*(reinterpret_cast<int64_t *>(ptr))) = size_;
-      memcpy(ptr, &size_, sizeof(int64_t));
-      ptr += sizeof(int64_t);
-      memcpy(ptr, string_.c_str(), size_);
-      ptr += size_;
-    } break;
-    case BINARY_TYPE: {
-      // len(64bit) + bindata
-      // (*(reinterpret_cast<int64_t *>(ptr))) = size_;
-      memcpy(ptr, &size_, sizeof(int64_t));
-      ptr += sizeof(int64_t);
-      memcpy(ptr, binary_.ptr, size_);
-      ptr += size_;
-    } break;
-    case OBJECT_TYPE: {
-      // (*(reinterpret_cast<int64_t *>(ptr))) = size_;
-      memcpy(ptr, &size_, sizeof(int64_t));
-      ptr += sizeof(int64_t);
+// Deserialize whole `buffer`. Parsed values hold `buffer`, so they stay valid
+// after the caller drops its handle.
+std::string Parse(Value &v, const Buffer &buffer);
 
-      // Serialize key-value pairs.
-      for (Object::const_iterator it = object_.begin(); it != object_.end();
-           ++it) {
-        // Emit type tag.
-        char ty = static_cast<char>(it->second.type_);
-        (*(reinterpret_cast<char *>(ptr))) = ty;
-        ptr++;
+//
+// Struct binding
+//
+// Serialize fixed-schema C++ structs directly, without building a Value tree.
+//
+//   struct Mesh {
+//     int64_t num_vertices;
+//     eson::Binary vertices;
+//     eson::Binary faces;
+//   };
+//
+//   // At global scope.
+//   ESON_FIELDS_BEGIN(Mesh)
+//     ESON_FIELD(num_vertices)
+//     ESON_FIELD(vertices)
+//     ESON_FIELD(faces)
+//   ESON_FIELDS_END()
+//
+//   std::vector<uint8_t> buf(eson::StructSize(mesh));
+//   eson::SerializeStruct(mesh, &buf[0]);
+//   std::string err = eson::ParseStruct(mesh, &buf[0]);
+//
+// Supported field types are bool, int64_t, double, std::string, Binary and
+// other bound structs(stored as an object). Output is an ordinary ESON object,
+// so `Parse` can read it and `ParseStruct` can read documents written through
+// `Value`(fields are looked up by key when they are not in declaration
+// order). Key lengths are compile-time constants, so the size of a struct
+// with only fixed size fields folds to a constant.
+//
 
-        // Emit key
-        const std::string &key = it->first;
-        memcpy(ptr, key.c_str(), key.size());
-        ptr += key.size();
-        (*(reinterpret_cast<char *>(ptr))) = '\0';  // null terminate
-        ptr++;
+template <typename T>
+struct Fields;  // Specialized by ESON_FIELDS_BEGIN/ESON_FIELDS_END.
 
-        // Emit element
-        ptr = it->second.Serialize(ptr);
-      }
-    } break;
-    case ARRAY_TYPE: {
-      // (*(reinterpret_cast<int64_t *>(ptr))) = size_;
-      memcpy(ptr, &size_, sizeof(int64_t));
-      ptr += sizeof(int64_t);
+#define ESON_FIELDS_BEGIN(type)                        \
+  namespace eson {                                     \
+  template <>                                          \
+  struct Fields<type> {                                \
+    template <typename V, typename S>                  \
+    static void Visit(V &visitor, S &s) {
+#define ESON_FIELD(name) visitor(#name, sizeof(#name) - 1, s.name);
+#define ESON_FIELDS_END() \
+  }                       \
+  }                       \
+  ;                       \
+  }
 
-      char ty = static_cast<char>(type_);
-      (*(reinterpret_cast<char *>(ptr))) = ty;
-      ptr++;
+namespace detail {
 
-      // (*(reinterpret_cast<int64_t *>(ptr))) = array_.size();
-      uint64_t arraySize = array_.size();
-      memcpy(ptr, &arraySize, sizeof(int64_t));
-      ptr += sizeof(int64_t);
+template <typename T>
+struct FieldTag {
+  static const char value = OBJECT_TYPE;  // Bound struct.
+};
+template <>
+struct FieldTag<bool> {
+  static const char value = BOOL_TYPE;
+};
+template <>
+struct FieldTag<int64_t> {
+  static const char value = INT64_TYPE;
+};
+template <>
+struct FieldTag<double> {
+  static const char value = FLOAT64_TYPE;
+};
+template <>
+struct FieldTag<std::string> {
+  static const char value = STRING_TYPE;
+};
+template <>
+struct FieldTag<Binary> {
+  static const char value = BINARY_TYPE;
+};
 
-      for (size_t i = 0; i < array_.size(); i++) {
-        ptr = array_[i].Serialize(ptr);
-      }
-    } break;
-    default:
-      assert(0);
-      break;
-  }
+template <typename T>
+uint64_t FieldSize(const T &s);  // Bound struct.
 
-  return ptr;
+inline uint64_t FieldSize(const bool &) { return 1; }
+inline uint64_t FieldSize(const int64_t &) { return sizeof(int64_t); }
+inline uint64_t FieldSize(const double &) { return sizeof(double); }
+inline uint64_t FieldSize(const std::string &s) {
+  return sizeof(int64_t) + s.size();
+}
+inline uint64_t FieldSize(const Binary &b) {
+  return sizeof(int64_t) + static_cast<uint64_t>(b.size);
 }
 
-// Forward decl.
-static const uint8_t *ParseElement(std::stringstream &err, Object &o,
-                                   const uint8_t *p);
+class StructSizer {
+ public:
+  StructSizer() : size(sizeof(int64_t)) {}
 
-static const uint8_t *ReadKey(std::string &key, const uint8_t *p) {
-  key = std::string(reinterpret_cast<const char *>(p));
+  template <typename T>
+  void operator()(const char *, size_t key_len, const T &v) {
+    size += 1 + key_len + 1 + FieldSize(v);  // tag + key + '\0' + data
+  }
 
-  p += key.length() + 1;  // + '\0'
+  uint64_t size;
+};
 
-  return p;
+template <typename T>
+uint64_t FieldSize(const T &s) {
+  StructSizer sizer;
+  Fields<T>::Visit(sizer, s);
+  return sizer.size;
 }
 
-static const uint8_t *ReadFloat64(double &v, const uint8_t *p) {
-  double val = 0.0;
-  memcpy(&val, p, sizeof(double));
-  v = val;
-  p += sizeof(double);
+template <typename T>
+uint8_t *WriteField(uint8_t *p, const T &s);  // Bound struct.
 
-  return p;
+inline uint8_t *WriteField(uint8_t *p, const bool &b) {
+  (*p) = b ? 1 : 0;
+  return p + 1;
 }
-
-static const uint8_t *ReadInt64(int64_t &v, const uint8_t *p) {
-  int64_t val = 0;
-  memcpy(&val, p, sizeof(int64_t));
-  v = val;
+inline uint8_t *WriteField(uint8_t *p, const int64_t &i) {
+  memcpy(p, &i, sizeof(int64_t));
+  return p + sizeof(int64_t);
+}
+inline uint8_t *WriteField(uint8_t *p, const double &d) {
+  memcpy(p, &d, sizeof(double));
+  return p + sizeof(double);
+}
+inline uint8_t *WriteField(uint8_t *p, const std::string &s) {
+  int64_t n = static_cast<int64_t>(s.size());
+  memcpy(p, &n, sizeof(int64_t));
   p += sizeof(int64_t);
-
-  return p;
+  if (n > 0) memcpy(p, s.data(), s.size());
+  return p + n;
 }
-
-static const uint8_t *ReadString(std::string &s, const uint8_t *p) {
-  // N + string data.
-  int64_t val;
-  memcpy(&val, p, sizeof(int64_t));
-  int64_t n = val;
+inline uint8_t *WriteField(uint8_t *p, const Binary &b) {
+  memcpy(p, &b.size, sizeof(int64_t));
   p += sizeof(int64_t);
-
-  assert(n >= 0);
-
-  s = std::string(reinterpret_cast<const char *>(p), static_cast<size_t>(n));
-  p += n;
-
-  return p;
+  if (b.size > 0) memcpy(p, b.ptr, static_cast<size_t>(b.size));
+  return p + b.size;
 }
 
-static const uint8_t *ReadBinary(const uint8_t *&b, int64_t &n,
-                                 const uint8_t *p) {
-  // N + bin data.
-  int64_t val;
-  memcpy(&val, p, sizeof(int64_t));
-
-  n = val;
-  p += sizeof(int64_t);
+class StructWriter {
+ public:
+  explicit StructWriter(uint8_t *p) : ptr(p) {}
 
-  assert(n >= 0);
+  template <typename T>
+  void operator()(const char *key, size_t key_len, const T &v) {
+    (*ptr) = static_cast<uint8_t>(FieldTag<T>::value);
+    ptr++;
+    memcpy(ptr, key, key_len + 1);  // Includes '\0'
+    ptr += key_len + 1;
+    ptr = WriteField(ptr, v);
+  }
 
-  // Just returns pointer address.
-  b = p;
-  p += n;
+  uint8_t *ptr;
+};
 
-  return p;
+template <typename T>
+uint8_t *WriteField(uint8_t *p, const T &s) {
+  uint64_t n = FieldSize(s);
+  memcpy(p, &n, sizeof(int64_t));
+  StructWriter writer(p + sizeof(int64_t));
+  Fields<T>::Visit(writer, s);
+  assert(writer.ptr == p + n);
+  return writer.ptr;
 }
 
-static const uint8_t *ReadObject(Object &o, const uint8_t *p) {
-  // N + object data.
-  int64_t val;
-  memcpy(&val, p, sizeof(int64_t));
-  int64_t n = val;
-  p += sizeof(int64_t);
-
-  assert(n >= 0);
-  (void)n;
-
-  std::stringstream ss;
-  const uint8_t *ptr = ParseElement(ss, o, p);
+// Returns the next element, or NULL for unknown element type or an element
+// which runs past `end`.
+inline const uint8_t *SkipElement(const uint8_t *p, const uint8_t *end) {
+  if (p >= end) return NULL;
+  char tag = static_cast<char>(*p);
+  p++;
+  const void *key_end = memchr(p, '\0', static_cast<size_t>(end - p));
+  if (!key_end) return NULL;
+  p = static_cast<const uint8_t *>(key_end) + 1;
 
-  return ptr;
+  uint64_t remain = static_cast<uint64_t>(end - p);
+  uint64_t size;  // Bytes of data.
+  int64_t n;
+  switch (tag) {
+    case BOOL_TYPE:
+      size = 1;
+      break;
+    case INT64_TYPE:
+    case FLOAT64_TYPE:
+      size = 8;
+      break;
+    case STRING_TYPE:
+    case BINARY_TYPE:
+      if (remain < sizeof(int64_t)) return NULL;
+      memcpy(&n, p, sizeof(int64_t));
+      if (n < 0) return NULL;
+      size = sizeof(int64_t) + static_cast<uint64_t>(n);
+      if (size < sizeof(int64_t)) return NULL;  // Wrapped around.
+      break;
+    case BINARY_CRC32C_TYPE: {
+      int64_t block_size;
+      if (remain < 2 * sizeof(int64_t)) return NULL;
+      memcpy(&n, p, sizeof(int64_t));
+      memcpy(&block_size, p + sizeof(int64_t), sizeof(int64_t));
+      if ((n < 0) || (block_size <= 0)) return NULL;
+      uint64_t un = static_cast<uint64_t>(n);
+      uint64_t bs = static_cast<uint64_t>(block_size);
+      uint64_t num_blocks = un / bs + ((un % bs) ? 1 : 0);
+      if (num_blocks > (remain - 2 * sizeof(int64_t)) / sizeof(uint32_t)) {
+        return NULL;
+      }
+      size = 2 * sizeof(int64_t) + num_blocks * sizeof(uint32_t);
+      if (un > remain - size) return NULL;
+      size += un;
+    } break;
+    case OBJECT_TYPE:
+    case ARRAY_TYPE:
+    case COLUMNS_TYPE:
+      // The size includes the int64 itself.
+      if (remain < sizeof(int64_t)) return NULL;
+      memcpy(&n, p, sizeof(int64_t));
+      if (n < static_cast<int64_t>(sizeof(int64_t))) return NULL;
+      size = static_cast<uint64_t>(n);
+      break;
+    case NULL_TYPE:
+      size = 0;
+      break;
+    case CRC32C_TYPE:
+      size = sizeof(uint32_t);
+      break;
+    case BINARY_REF_TYPE:
+      size = 2 * sizeof(int64_t);  // offset + N
+      break;
+    default:
+      return NULL;
+  }
+  if (size > remain) return NULL;
+  return p + size;
 }
 
-static const uint8_t *ParseElement(std::stringstream &err, Object &o,
-                                   const uint8_t *p) {
-  const uint8_t *ptr = p;
-  (void)err;
+template <typename T>
+const uint8_t *ReadField(const uint8_t *p, const uint8_t *end, T &s,
+                         std::string &err);  // Bound struct.
+
+inline const uint8_t *ReadField(const uint8_t *p, const uint8_t *end,
+                                bool &b, std::string &err) {
+  if (end - p < 1) {
+    err += "Truncated bool.\n";
+    return end;
+  }
+  b = ((*p) != 0);
+  return p + 1;
+}
+inline const uint8_t *ReadField(const uint8_t *p, const uint8_t *end,
+                                int64_t &i, std::string &err) {
+  if (end - p < static_cast<int64_t>(sizeof(int64_t))) {
+    err += "Truncated int64.\n";
+    return end;
+  }
+  memcpy(&i, p, sizeof(int64_t));
+  return p + sizeof(int64_t);
+}
+inline const uint8_t *ReadField(const uint8_t *p, const uint8_t *end,
+                                double &d, std::string &err) {
+  if (end - p < static_cast<int64_t>(sizeof(double))) {
+    err += "Truncated double.\n";
+    return end;
+  }
+  memcpy(&d, p, sizeof(double));
+  return p + sizeof(double);
+}
+inline const uint8_t *ReadField(const uint8_t *p, const uint8_t *end,
+                                std::string &s, std::string &err) {
+  int64_t n;
+  if (end - p < static_cast<int64_t>(sizeof(int64_t))) {
+    err += "Invalid string length.\n";
+    return end;
+  }
+  memcpy(&n, p, sizeof(int64_t));
+  p += sizeof(int64_t);
+  if ((n < 0) || (n > end - p)) {
+    err += "Invalid string length.\n";
+    return end;
+  }
+  s.assign(reinterpret_cast<const char *>(p), static_cast<size_t>(n));
+  return p + n;
+}
+inline const uint8_t *ReadField(const uint8_t *p, const uint8_t *end,
+                                Binary &b, std::string &err) {
+  int64_t n;
+  if (end - p < static_cast<int64_t>(sizeof(int64_t))) {
+    err += "Invalid binary length.\n";
+    return end;
+  }
+  memcpy(&n, p, sizeof(int64_t));
+  p += sizeof(int64_t);
+  if ((n < 0) || (n > end - p)) {
+    err += "Invalid binary length.\n";
+    return end;
+  }
+  b.ptr = p;  // Just save a pointer.
+  b.size = n;
+  return p + n;
+}
+
+class StructReader {
+ public:
+  StructReader(const uint8_t *begin, const uint8_t *end, std::string &err)
+      : begin_(begin), cur_(begin), end_(end), err_(err) {}
+
+  template <typename T>
+  void operator()(const char *key, size_t key_len, T &v) {
+    if (!err_.empty()) return;
+
+    // Fast path: fields are stored in declaration order.
+    const uint8_t *e = cur_;
+    if ((e >= end_) || !Match(e, key, key_len)) {
+      e = Find(key, key_len);
+      if (!e) return;  // Missing field. Leave it untouched.
+    }
+
+    if (static_cast<char>(*e) != FieldTag<T>::value) {
+      err_ += "Type mismatch for field `" + std::string(key) + "`.\n";
+      return;
+    }
+
+    cur_ = ReadField(e + 1 + key_len + 1, end_, v, err_);
+  }
+
+ private:
+  bool Match(const uint8_t *e, const char *key, size_t key_len) const {
+    return (static_cast<size_t>(end_ - e) > key_len + 1) &&
+           (memcmp(e + 1, key, key_len + 1) == 0);
+  }
+
+  const uint8_t *Find(const char *key, size_t key_len) const {
+    const uint8_t *e = begin_;
+    while (e < end_) {
+      if (Match(e, key, key_len)) return e;
+      e = SkipElement(e, end_);
+      if (!e) {
+        err_ += "Invalid element while looking for `" + std::string(key) +
+                "`.\n";
+        return NULL;
+      }
+    }
+    return NULL;
+  }
+
+  const uint8_t *begin_;
+  const uint8_t *cur_;
+  const uint8_t *end_;
+  std::string &err_;
+};
+
+template <typename T>
+const uint8_t *ReadField(const uint8_t *p, const uint8_t *end, T &s,
+                         std::string &err) {
+  int64_t n;
+  if (end - p < static_cast<int64_t>(sizeof(int64_t))) {
+    err += "Invalid object length.\n";
+    return end;
+  }
+  memcpy(&n, p, sizeof(int64_t));
+  if ((n < static_cast<int64_t>(sizeof(int64_t))) || (n > end - p)) {
+    err += "Invalid object length.\n";
+    return end;
+  }
+  StructReader reader(p + sizeof(int64_t), p + n, err);
+  Fields<T>::Visit(reader, s);
+  return p + n;
+}
+
+}  // namespace detail
+
+/// Serialized size of a bound struct.
+template <typename T>
+uint64_t StructSize(const T &s) {
+  return detail::FieldSize(s);
+}
+
+/// Serialize a bound struct to memory `p`, which must have `StructSize(s)`
+/// bytes. Return next data location.
+template <typename T>
+uint8_t *SerializeStruct(const T &s, uint8_t *p) {
+  return detail::WriteField(p, s);
+}
+
+/// Deserialize a bound struct from `size` bytes at `p`. Binary fields point
+/// into `p`. Returns error string. Empty if success.
+template <typename T>
+std::string ParseStruct(T &s, const uint8_t *p, uint64_t size) {
+  std::string err;
+  int64_t n;
+  if (size < sizeof(int64_t)) {
+    return "Invalid object length.\n";
+  }
+  memcpy(&n, p, sizeof(int64_t));
+  if (n < 0) {
+    return "Compact encoding is not supported by ParseStruct.\n";
+  }
+  detail::ReadField(p, p + size, s, err);
+  return err;
+}
+
+/// Deserialize a bound struct from memory `p`, trusting the size in its
+/// header. Prefer the overload with a size for untrusted data.
+template <typename T>
+std::string ParseStruct(T &s, const uint8_t *p) {
+  int64_t n;
+  memcpy(&n, p, sizeof(int64_t));
+  if (n < 0) {
+    return "Compact encoding is not supported by ParseStruct.\n";
+  }
+  return ParseStruct(s, p, static_cast<uint64_t>(n));
+}
+
+/// Access pattern hint for a range of the mapped file.
+typedef enum {
+  ACCESS_NORMAL = 0,
+  ACCESS_SEQUENTIAL = 1,  // Aggressive readahead(MADV_SEQUENTIAL)
+  ACCESS_RANDOM = 2,      // No readahead(MADV_RANDOM)
+  ACCESS_WILLNEED = 3,    // Start reading now(MADV_WILLNEED)
+  ACCESS_DONTNEED = 4     // Pages can be dropped(MADV_DONTNEED)
+} Access;
+
+struct LoadOption {
+  Access access;  // Access hint for the whole file.
+
+  // Pre-fault all pages at load time(MAP_POPULATE).
+  bool populate;
+
+  // Read the file into anonymous memory backed by transparent huge
+  // pages(MADV_HUGEPAGE). Costs a full read at load time, but removes most of
+  // page faults and TLB misses for hot documents.
+  bool huge_pages;
+
+  char pad2_[2];
+
+  LoadOption() : access(ACCESS_NORMAL), populate(false), huge_pages(false) {}
+};
+
+class ESON {
+ public:
+  ESON();
+  ~ESON();
+
+  /// Load data from a file. File is mapped with mmap() and paged in on
+  /// demand.
+  bool Load(const char *filename);
+  bool Load(const char *filename, const LoadOption &option);
+
+  /// Dump data to a file.
+  bool Dump(const char *filename);
+
+  /// Parse loaded data. Binary values point into the mapped memory and keep
+  /// it mapped, so `v` may outlive this object.
+  std::string Parse(Value &v) const;
+
+  const uint8_t *Data() const { return data_; }
+  uint64_t Size() const { return size_; }
+
+  /// Handle to the mapped memory. The mapping is released when this object
+  /// and all handles(including parsed values) are gone.
+  const Buffer &GetBuffer() const { return buffer_; }
+
+  /// Give an access hint for [ptr, ptr + len) of the loaded data.
+  /// Range is expanded to page boundaries.
+  /// Returns false if the range is out of the data or hint is not supported.
+  /// On Windows only ACCESS_WILLNEED has an effect(PrefetchVirtualMemory);
+  /// other hints are accepted and ignored.
+  bool Advise(const uint8_t *ptr, uint64_t len, Access access);
+  bool Advise(const Binary &bin, Access access);
+
+  /// Touch pages of given ranges(e.g. Binary of subtrees visited next) in a
+  /// background thread so that the traversal does not stall on page faults.
+  /// Any running prefetch is cancelled first.
+  bool Prefetch(const std::vector<Binary> &ranges);
+
+  /// Wait for the background prefetch to finish.
+  void WaitPrefetch();
+
+  /// Cancel the background prefetch.
+  void CancelPrefetch();
+
+ private:
+  ESON(const ESON &);
+  ESON &operator=(const ESON &);
+
+  void Unload();
+
+  Buffer buffer_;       /// Owns the mapping
+  uint8_t *data_;       /// Pointer to data
+  uint64_t size_;       /// Total data size
+  uint64_t map_size_;   /// Size of the mapping
+  uint64_t page_size_;  /// Page size
+
+  std::vector<Binary> prefetch_ranges_;
+  void *prefetch_thread_;  /// Opaque thread handle.
+  volatile int prefetch_cancel_;
+
+  bool valid_;
+  bool anonymous_;  /// Mapping is an anonymous copy of the file.
+  char pad2_[2];
+};
+
+//
+// File writer
+//
+
+struct SaveOption {
+  SerializeOption serialize;
+
+  // Bytes per write. Rounded up to a multiple of 4096. Two buffers of this
+  // size are allocated.
+  uint64_t buffer_size;
+
+  // Bypass the page cache(O_DIRECT, F_NOCACHE or FILE_FLAG_NO_BUFFERING).
+  // Falls back to buffered writes if the file system does not support it.
+  // Buffered writes are flushed and dropped from the page cache chunk by
+  // chunk on Linux.
+  bool direct;
+  char pad7_[7];
+
+  SaveOption() : buffer_size(8 * 1024 * 1024), direct(true) {}
+};
+
+/// Serialize `v` to a file. Serialization runs on the calling thread while a
+/// second thread writes the previous chunk, so serialization and disk I/O
+/// overlap and only two chunks of the document are in memory.
+/// Returns error string. Empty if success.
+std::string SaveFile(const char *filename, const Value &v,
+                     const SaveOption &option = SaveOption());
+
+//
+// Streaming writer
+//
+
+/// Writes a document element by element without building a `Value` tree.
+/// Sizes of objects and arrays are written back when they are closed, so only
+/// `buffer_size` bytes are kept in memory. Writing to a file which is larger
+/// than the buffer requires the file to be seekable.
+/// Writes the fixed encoding.
+///
+///   eson::StreamWriter writer(fp);
+///   writer.BeginObject("");  // toplevel
+///   writer.Int64("id", 3);
+///   writer.BeginArray("scale");
+///   writer.Float64("", 1.0);  // keys of array elements are ignored
+///   writer.End();
+///   writer.End();
+///   std::string err = writer.Finish();
+class StreamWriter {
+ public:
+  explicit StreamWriter(FILE *fp, uint64_t buffer_size = 4 * 1024 * 1024);
+
+  /// Write to memory. `out` holds the document after `Finish`.
+  explicit StreamWriter(std::vector<uint8_t> *out);
+
+  // Key is ignored for the toplevel object and elements of an array.
+  void BeginObject(const std::string &key);
+  void BeginArray(const std::string &key);
+
+  /// Close the innermost object or array.
+  void End();
+
+  void Null(const std::string &key);
+  void Bool(const std::string &key, bool b);
+  void Int64(const std::string &key, int64_t i);
+  void Float64(const std::string &key, double d);
+  void String(const std::string &key, const char *s, uint64_t n);
+  void Binary(const std::string &key, const uint8_t *p, uint64_t n);
+
+  /// Number of bytes written so far.
+  uint64_t Tell() const { return flushed_ + used_; }
+
+  /// Number of open objects and arrays.
+  size_t Depth() const { return stack_.size(); }
+
+  /// Finish the document. Returns error string. Empty if success.
+  std::string Finish();
+
+ private:
+  StreamWriter(const StreamWriter &);
+  StreamWriter &operator=(const StreamWriter &);
+
+  uint8_t *Reserve(uint64_t n);
+  void Flush();
+  void Write(const uint8_t *p, uint64_t n);
+  void Patch(uint64_t offset, uint64_t value);
+  uint8_t *BeginElement(char tag, const std::string &key, uint64_t n);
+  void BeginContainer(char tag, const std::string &key);
+
+  FILE *fp_;
+  std::vector<uint8_t> *out_;
+  std::vector<uint8_t> buf_;
+  uint64_t used_;       /// Bytes in `buf_`
+  uint64_t flushed_;    /// Bytes written to the file
+  int64_t base_;        /// File position where the document starts
+  uint64_t max_size_;   /// Capacity of `buf_` when writing to a file
+  std::vector<uint64_t> stack_;  /// Offset of the size field of open
+                                 /// containers. Bit 63 marks an array.
+  std::string err_;
+};
+
+//
+// JSON conversion
+//
+
+/// Convert JSON to ESON. Input and output are streamed with bounded memory, so
+/// `out` must be seekable for documents larger than a few MB.
+/// The toplevel value must be an object. Integers which fit in int64 become
+/// INT64, other numbers FLOAT64.
+/// Returns error string. Empty if success.
+std::string JSONToESON(FILE *in, FILE *out);
+std::string JSONToESON(const char *json, size_t len, std::vector<uint8_t> &out);
+
+/// Convert ESON(fixed or compact encoding) to JSON. Binary is written as a
+/// base64 string. Checksums are not verified.
+/// Returns error string. Empty if success.
+std::string ESONToJSON(FILE *in, FILE *out);
+std::string ESONToJSON(const uint8_t *p, uint64_t size, std::string &out);
+
+}  // namespace eson
+
+#ifdef ESON_IMPLEMENTATION
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#if defined(__MINGW32__)
+#include <windows.h>  //  File mapping
+#else
+#include <Windows.h>
+#endif
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace eson {
+
+//
+// Buffer
+//
+
+static void ReleaseHeap(void *ctx, uint8_t *data, uint64_t size) {
+  (void)ctx;
+  (void)size;
+  delete[] data;
+}
+
+Buffer Buffer::Allocate(uint64_t n) {
+  return Wrap(new uint8_t[static_cast<size_t>(n)], n, ReleaseHeap, NULL);
+}
+
+Buffer Buffer::Copy(const uint8_t *p, uint64_t n) {
+  Buffer buffer = Allocate(n);
+  if (n > 0) memcpy(buffer.Data(), p, static_cast<size_t>(n));
+  return buffer;
+}
+
+Buffer Buffer::Wrap(uint8_t *data, uint64_t n, ReleaseFunc release,
+                    void *ctx) {
+  Buffer buffer;
+  buffer.block_ = new Block();
+  buffer.block_->data = data;
+  buffer.block_->size = n;
+  buffer.block_->release = release;
+  buffer.block_->ctx = ctx;
+  buffer.block_->refcount = 1;
+  return buffer;
+}
+
+void Buffer::Destroy(Block *block) {
+  if (block->release) block->release(block->ctx, block->data, block->size);
+  delete block;
+}
+
+//
+// CRC32C
+//
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define ESON_CRC32C_SSE42
+#endif
+
+// Zero operators are used to combine three CRCs computed in parallel.
+static const size_t kCRC32CLong = 8192;
+static const size_t kCRC32CShort = 256;
+
+struct CRC32CTable {
+  uint32_t table[8][256];  // Slicing-by-8
+  uint32_t long_zeros[4][256];
+  uint32_t short_zeros[4][256];
+  bool hardware;
+  char pad7_[7];
+};
+
+static uint32_t GF2MatrixTimes(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1) sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void GF2MatrixSquare(uint32_t *square, const uint32_t *mat) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = GF2MatrixTimes(mat, mat[n]);
+  }
+}
+
+// Build tables which apply `len` zero bytes to a CRC.
+static void CRC32CZeros(uint32_t zeros[][256], size_t len) {
+  uint32_t even[32];
+  uint32_t odd[32];
+
+  odd[0] = 0x82f63b78;  // Reflected Castagnoli polynomial.
+  uint32_t row = 1;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  GF2MatrixSquare(even, odd);  // 2 zero bits
+  GF2MatrixSquare(odd, even);  // 4 zero bits
+
+  // Each square doubles the number of zero bits: 8, 16, 32, ...
+  uint32_t *op = odd;
+  do {
+    GF2MatrixSquare(even, odd);
+    len >>= 1;
+    op = even;
+    if (len == 0) break;
+    GF2MatrixSquare(odd, even);
+    len >>= 1;
+    op = odd;
+  } while (len);
+
+  for (uint32_t n = 0; n < 256; n++) {
+    zeros[0][n] = GF2MatrixTimes(op, n);
+    zeros[1][n] = GF2MatrixTimes(op, n << 8);
+    zeros[2][n] = GF2MatrixTimes(op, n << 16);
+    zeros[3][n] = GF2MatrixTimes(op, n << 24);
+  }
+}
+
+static CRC32CTable *MakeCRC32CTable() {
+  CRC32CTable *t = new CRC32CTable();
+
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = (crc & 1) ? ((crc >> 1) ^ 0x82f63b78) : (crc >> 1);
+    }
+    t->table[0][n] = crc;
+  }
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = t->table[0][n];
+    for (int k = 1; k < 8; k++) {
+      crc = t->table[0][crc & 0xff] ^ (crc >> 8);
+      t->table[k][n] = crc;
+    }
+  }
+
+  CRC32CZeros(t->long_zeros, kCRC32CLong);
+  CRC32CZeros(t->short_zeros, kCRC32CShort);
+
+#ifdef ESON_CRC32C_SSE42
+  __builtin_cpu_init();
+  t->hardware = __builtin_cpu_supports("sse4.2");
+#else
+  t->hardware = false;
+#endif
+
+  return t;
+}
+
+static const CRC32CTable &GetCRC32CTable() {
+  static const CRC32CTable &table = *MakeCRC32CTable();
+  return table;
+}
+
+static uint32_t CRC32CShift(const uint32_t zeros[][256], uint32_t crc) {
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+         zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint64_t Load64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(uint64_t));
+  return v;
+}
+
+static uint32_t CRC32CSoftware(const CRC32CTable &t, uint32_t crc,
+                               const uint8_t *p, uint64_t n) {
+  while (n >= 8) {
+    uint64_t word = Load64(p) ^ crc;
+    crc = t.table[7][word & 0xff] ^ t.table[6][(word >> 8) & 0xff] ^
+          t.table[5][(word >> 16) & 0xff] ^ t.table[4][(word >> 24) & 0xff] ^
+          t.table[3][(word >> 32) & 0xff] ^ t.table[2][(word >> 40) & 0xff] ^
+          t.table[1][(word >> 48) & 0xff] ^ t.table[0][word >> 56];
+    p += 8;
+    n -= 8;
+  }
+  while (n) {
+    crc = t.table[0][(crc ^ (*p)) & 0xff] ^ (crc >> 8);
+    p++;
+    n--;
+  }
+  return crc;
+}
+
+#ifdef ESON_CRC32C_SSE42
+// Three independent crc32 instructions are in flight to hide their latency,
+// then the CRCs are combined with the zero operators.
+__attribute__((target("sse4.2"))) static uint32_t CRC32CHardware(
+    const CRC32CTable &t, uint32_t crc, const uint8_t *p, uint64_t n) {
+  uint64_t crc0 = crc;
+
+  while (n && (reinterpret_cast<uintptr_t>(p) & 7)) {
+    crc0 = __builtin_ia32_crc32qi(static_cast<uint32_t>(crc0), *p);
+    p++;
+    n--;
+  }
+
+  while (n >= kCRC32CLong * 3) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const uint8_t *end = p + kCRC32CLong;
+    do {
+      crc0 = __builtin_ia32_crc32di(crc0, Load64(p));
+      crc1 = __builtin_ia32_crc32di(crc1, Load64(p + kCRC32CLong));
+      crc2 = __builtin_ia32_crc32di(crc2, Load64(p + 2 * kCRC32CLong));
+      p += 8;
+    } while (p < end);
+    crc0 = CRC32CShift(t.long_zeros, static_cast<uint32_t>(crc0)) ^ crc1;
+    crc0 = CRC32CShift(t.long_zeros, static_cast<uint32_t>(crc0)) ^ crc2;
+    p += 2 * kCRC32CLong;
+    n -= 3 * kCRC32CLong;
+  }
+
+  while (n >= kCRC32CShort * 3) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const uint8_t *end = p + kCRC32CShort;
+    do {
+      crc0 = __builtin_ia32_crc32di(crc0, Load64(p));
+      crc1 = __builtin_ia32_crc32di(crc1, Load64(p + kCRC32CShort));
+      crc2 = __builtin_ia32_crc32di(crc2, Load64(p + 2 * kCRC32CShort));
+      p += 8;
+    } while (p < end);
+    crc0 = CRC32CShift(t.short_zeros, static_cast<uint32_t>(crc0)) ^ crc1;
+    crc0 = CRC32CShift(t.short_zeros, static_cast<uint32_t>(crc0)) ^ crc2;
+    p += 2 * kCRC32CShort;
+    n -= 3 * kCRC32CShort;
+  }
+
+  while (n >= 8) {
+    crc0 = __builtin_ia32_crc32di(crc0, Load64(p));
+    p += 8;
+    n -= 8;
+  }
+  while (n) {
+    crc0 = __builtin_ia32_crc32qi(static_cast<uint32_t>(crc0), *p);
+    p++;
+    n--;
+  }
+
+  return static_cast<uint32_t>(crc0);
+}
+#endif
+
+uint32_t CRC32C(uint32_t crc, const uint8_t *p, uint64_t n) {
+  const CRC32CTable &t = GetCRC32CTable();
+  crc = ~crc;
+#ifdef ESON_CRC32C_SSE42
+  if (t.hardware) {
+    return ~CRC32CHardware(t, crc, p, n);
+  }
+#endif
+  return ~CRC32CSoftware(t, crc, p, n);
+}
+
+//
+// Varint
+//
+
+#ifndef UINT64_C
+#define UINT64_C(c) c##ULL
+#endif
+
+// Compact document header: (0x80 | version) << 56 | document size.
+static const uint64_t kCompactHeader = static_cast<uint64_t>(0x81) << 56;
+static const uint64_t kHeaderSizeMask = (static_cast<uint64_t>(1) << 56) - 1;
+
+static int CountTrailingZeros64(uint64_t x) {
+#if defined(_MSC_VER) && defined(_M_X64)
+  unsigned long i;
+  _BitScanForward64(&i, x);
+  return static_cast<int>(i);
+#elif defined(_MSC_VER)
+  unsigned long i;
+  if (_BitScanForward(&i, static_cast<unsigned long>(x))) {
+    return static_cast<int>(i);
+  }
+  _BitScanForward(&i, static_cast<unsigned long>(x >> 32));
+  return static_cast<int>(i) + 32;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
+
+static uint64_t ZigZagEncode(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+static int64_t ZigZagDecode(uint64_t v) {
+  return static_cast<int64_t>((v >> 1) ^ (~(v & 1) + 1));
+}
+
+static uint64_t VarintSize(uint64_t v) {
+  uint64_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static uint8_t *WriteVarint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) {
+    (*p++) = static_cast<uint8_t>(v | 0x80);
+    v >>= 7;
+  }
+  (*p++) = static_cast<uint8_t>(v);
+  return p;
+}
+
+// Returns next data location, or NULL if the varint is broken.
+static const uint8_t *ReadVarint(const uint8_t *p, const uint8_t *end,
+                                 uint64_t &v) {
+  if (end - p >= 8) {
+    // Up to 8 bytes(56 bits) without a branch per byte: find the last byte
+    // from the continuation bits, then pack 7-bit groups in parallel.
+    uint64_t word = Load64(p);
+    uint64_t stops = ~word & UINT64_C(0x8080808080808080);
+    if (stops) {
+      int bits = CountTrailingZeros64(stops) + 1;
+      uint64_t x = word & UINT64_C(0x7f7f7f7f7f7f7f7f);
+      if (bits < 64) x &= (static_cast<uint64_t>(1) << bits) - 1;
+      x = ((x & UINT64_C(0x7f007f007f007f00)) >> 1) | (x & UINT64_C(0x007f007f007f007f));
+      x = ((x & UINT64_C(0x3fff00003fff0000)) >> 2) | (x & UINT64_C(0x00003fff00003fff));
+      x = ((x & UINT64_C(0x0fffffff00000000)) >> 4) | (x & UINT64_C(0x000000000fffffff));
+      v = x;
+      return p + bits / 8;
+    }
+  }
+
+  uint64_t result = 0;
+  for (int shift = 0; (shift < 64) && (p < end); shift += 7) {
+    uint8_t byte = (*p++);
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      v = result;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static uint64_t LengthSize(uint64_t n, bool compact) {
+  return compact ? VarintSize(n) : sizeof(int64_t);
+}
+
+static uint8_t *WriteLength(uint8_t *p, uint64_t n, bool compact) {
+  if (compact) {
+    return WriteVarint(p, n);
+  }
+  memcpy(p, &n, sizeof(int64_t));
+  return p + sizeof(int64_t);
+}
+
+//
+// Columnar arrays. Content is the number of rows and fields, then tag, key and
+// column size of each field, then the columns. The layout is the same in both
+// encodings so that columns can be read in place.
+//
+
+struct ColumnField {
+  const char *key;
+  size_t key_len;
+  Column column;
+};
+
+static bool IsColumnType(char tag) {
+  return (tag == BOOL_TYPE) || (tag == INT64_TYPE) || (tag == FLOAT64_TYPE) ||
+         (tag == STRING_TYPE) || (tag == BINARY_TYPE);
+}
+
+// Bytes per row of a fixed size column. 0 for string and binary.
+static uint64_t ColumnStride(char tag) {
+  if (tag == BOOL_TYPE) return 1;
+  if ((tag == INT64_TYPE) || (tag == FLOAT64_TYPE)) return sizeof(int64_t);
+  return 0;
+}
+
+// Read the schema of columnar content [p, end). Offsets of string and binary
+// columns are only checked when `check_offsets` is set, since that reads them.
+// Returns an error message, or NULL if success.
+static const char *ReadColumns(const uint8_t *p, const uint8_t *end,
+                               uint64_t &rows,
+                               std::vector<ColumnField> &fields,
+                               bool check_offsets) {
+  if (end - p < static_cast<int64_t>(2 * sizeof(int64_t))) {
+    return "Truncated columnar array";
+  }
+  int64_t num_rows, num_fields;
+  memcpy(&num_rows, p, sizeof(int64_t));
+  memcpy(&num_fields, p + sizeof(int64_t), sizeof(int64_t));
+  p += 2 * sizeof(int64_t);
+  // A field takes 10 bytes at least, and its column a byte per row at
+  // least, which bounds the number of rows.
+  if ((num_rows <= 0) || (static_cast<uint64_t>(num_rows) > kHeaderSizeMask) ||
+      (num_fields <= 0) || (num_fields > end - p)) {
+    return "Invalid size of columnar array";
+  }
+  rows = static_cast<uint64_t>(num_rows);
+
+  fields.resize(static_cast<size_t>(num_fields));
+  std::vector<uint64_t> sizes(fields.size());
+  for (size_t f = 0; f < fields.size(); f++) {
+    ColumnField &field = fields[f];
+    if (p == end) return "Truncated columnar array";
+    field.column.type = static_cast<char>(*p++);
+    if (!IsColumnType(field.column.type)) return "Invalid column type";
+
+    const void *key_end = memchr(p, '\0', static_cast<size_t>(end - p));
+    if (!key_end) return "Unterminated key";
+    field.key = reinterpret_cast<const char *>(p);
+    field.key_len =
+        static_cast<size_t>(static_cast<const uint8_t *>(key_end) - p);
+    p += field.key_len + 1;
+    // Same order as the keys of an object.
+    if ((f > 0) && (strcmp(fields[f - 1].key, field.key) >= 0)) {
+      return "Column keys are not sorted";
+    }
+
+    if (end - p < static_cast<int64_t>(sizeof(int64_t))) {
+      return "Truncated columnar array";
+    }
+    memcpy(&sizes[f], p, sizeof(int64_t));
+    p += sizeof(int64_t);
+
+    uint64_t stride = ColumnStride(field.column.type);
+    if (stride ? (sizes[f] != rows * stride)
+               : (sizes[f] < (rows + 1) * sizeof(int64_t))) {
+      return "Invalid column size";
+    }
+  }
+
+  for (size_t f = 0; f < fields.size(); f++) {
+    Column &column = fields[f].column;
+    if (sizes[f] > static_cast<uint64_t>(end - p)) {
+      return "Truncated columnar array";
+    }
+    column.rows = rows;
+    column.data = p;
+    if (!ColumnStride(column.type)) {
+      uint64_t table_size = (rows + 1) * sizeof(int64_t);
+      column.offsets = p;
+      column.data = p + table_size;
+      if (check_offsets) {
+        uint64_t prev = 0;
+        for (uint64_t i = 0; i <= rows; i++) {
+          uint64_t offset;
+          memcpy(&offset, p + i * sizeof(int64_t), sizeof(int64_t));
+          if ((offset < prev) || ((i == 0) && (offset != 0))) {
+            return "Invalid column offsets";
+          }
+          prev = offset;
+        }
+        if (prev != sizes[f] - table_size) return "Invalid column offsets";
+      }
+    }
+    p += sizes[f];
+  }
+  if (p != end) return "Invalid size of columnar array";
+
+  return NULL;
+}
+
+uint64_t Value::ComputeColumnsSize() const {
+  LoadRows();
+  const Array &rows = *array_;
+  // Rows of empty objects stay an array. Without fields, nothing would bound
+  // the row count of the columnar encoding.
+  if (rows.empty() || !rows[0].IsObject() || rows[0].object_->empty()) {
+    return 0;
+  }
+
+  const Object &schema = *(rows[0].object_);
+  uint64_t n = rows.size();
+  uint64_t content = 2 * sizeof(int64_t);  // rows + fields
+  for (Object::const_iterator it = schema.begin(); it != schema.end(); ++it) {
+    char tag = it->second.Tag();
+    if (!IsColumnType(tag)) return 0;
+    content += 1 + it->first.size() + 1 + sizeof(int64_t);  // tag key size
+    uint64_t stride = ColumnStride(tag);
+    content += stride ? (n * stride) : ((n + 1) * sizeof(int64_t));
+  }
+
+  for (size_t r = 0; r < rows.size(); r++) {
+    const Value &row = rows[r];
+    if (!row.IsObject() || row.checksum_ ||
+        (row.object_->size() != schema.size())) {
+      return 0;
+    }
+    Object::const_iterator s = schema.begin();
+    for (Object::const_iterator it = row.object_->begin();
+         it != row.object_->end(); ++it, ++s) {
+      if ((it->first != s->first) || (it->second.Tag() != s->second.Tag())) {
+        return 0;
+      }
+      if (it->second.IsString()) {
+        content += it->second.string_->size();
+      } else if (it->second.IsBinary()) {
+        content += it->second.size_;
+      }
+    }
+  }
+
+  return content;
+}
+
+void Value::DecodeRows() const {
+  uint64_t n = 0;
+  std::vector<ColumnField> fields;
+  const char *err =
+      ReadColumns(columns_, columns_end_, n, fields, false);
+  assert(!err);  // Checked by `Parse`.
+  (void)err;
+
+  std::vector<std::string> keys(fields.size());
+  for (size_t f = 0; f < fields.size(); f++) {
+    keys[f].assign(fields[f].key, fields[f].key_len);
+  }
+
+  Array rows(static_cast<size_t>(n));
+  for (uint64_t r = 0; r < n; r++) {
+    Object row;
+    for (size_t f = 0; f < fields.size(); f++) {
+      const Column &column = fields[f].column;
+      Value v;
+      uint64_t len;
+      switch (column.type) {
+        case BOOL_TYPE:
+          v = Value(column.Bool(r));
+          break;
+        case INT64_TYPE:
+          v = Value(column.Int64(r));
+          break;
+        case FLOAT64_TYPE:
+          v = Value(column.Float64(r));
+          break;
+        case STRING_TYPE: {
+          const uint8_t *s = column.Bytes(r, len);
+          v = Value(std::string(reinterpret_cast<const char *>(s),
+                                static_cast<size_t>(len)));
+        } break;
+        case BINARY_TYPE: {
+          const uint8_t *b = column.Bytes(r, len);
+          v = Value(b, len, source_buffer_);  // Just save a pointer.
+        } break;
+        default:
+          assert(0);
+          break;
+      }
+      row.insert(row.end(), Object::value_type(keys[f], v));  // Sorted
+    }
+    rows[static_cast<size_t>(r)] = Value(row);
+  }
+
+  array_ = Shared<Array>(rows);
+  rows_pending_ = false;
+}
+
+bool Value::GetColumn(const std::string &key, Column &column) const {
+  if (!IsArray() || !columns_ || modified_) {
+    return false;
+  }
+
+  uint64_t n = 0;
+  std::vector<ColumnField> fields;
+  if (ReadColumns(columns_, columns_end_, n, fields, false)) {
+    return false;
+  }
+  for (size_t f = 0; f < fields.size(); f++) {
+    if ((fields[f].key_len == key.size()) &&
+        (memcmp(fields[f].key, key.data(), key.size()) == 0)) {
+      column = fields[f].column;
+      column.buffer = source_buffer_;
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// Checksum of objects. It covers all bytes of the object except the checksum
+// element itself and payloads of checksummed binaries(they have their own
+// checksums). Excluded ranges are skipped by all enclosing objects.
+//
+
+struct ChecksumScope {
+  const uint8_t *from;  // Bytes before this are already in `crc`.
+  uint32_t crc;
+  uint32_t stored;  // Checksum stored in the data(parse only).
+};
+
+static void SkipChecksumRange(std::vector<ChecksumScope> &scopes,
+                              const uint8_t *begin, const uint8_t *end) {
+  for (size_t i = 0; i < scopes.size(); i++) {
+    scopes[i].crc = CRC32C(scopes[i].crc, scopes[i].from,
+                           static_cast<uint64_t>(begin - scopes[i].from));
+    scopes[i].from = end;
+  }
+}
+
+static uint32_t CloseChecksumScope(std::vector<ChecksumScope> &scopes,
+                                   const uint8_t *end) {
+  ChecksumScope &scope = scopes.back();
+  uint32_t crc = CRC32C(scope.crc, scope.from,
+                        static_cast<uint64_t>(end - scope.from));
+  scopes.pop_back();
+  return crc;
+}
+
+bool Value::VerifyChecksum(uint64_t offset, uint64_t len) const {
+  if (!IsBinary() || !checksum_ || !checksum_table_) {
+    return true;
+  }
+  if ((len == 0) || (offset >= size_)) {
+    return true;
+  }
+  if (len > size_ - offset) {
+    len = size_ - offset;
+  }
+
+  uint64_t first = offset / checksum_block_size_;
+  uint64_t last = (offset + len - 1) / checksum_block_size_;
+  for (uint64_t b = first; b <= last; b++) {
+    uint64_t begin = b * checksum_block_size_;
+    uint64_t n = std::min(checksum_block_size_, size_ - begin);
+    uint32_t stored;
+    memcpy(&stored, checksum_table_ + b * sizeof(uint32_t), sizeof(uint32_t));
+    if (CRC32C(0, binary_.ptr + begin, n) != stored) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+//
+// File output of `SaveFile`. The serializer fills one aligned buffer while a
+// thread writes the previous one.
+//
+
+// Alignment of buffers, file offsets and sizes for direct I/O.
+static const uint64_t kDirectAlignment = 4096;
+
+// Fields of up to this size are written after a single check for the end of
+// the chunk, so they may run over it. Those bytes move to the next chunk.
+static const uint64_t kChunkSlack = 64;
+
+static const uint64_t kMinChunkSize = 64 * 1024;
+
+static uint64_t AlignUp(uint64_t n, uint64_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+static uint8_t *AllocateAligned(uint64_t n) {
+#ifdef _WIN32
+  return static_cast<uint8_t *>(
+      _aligned_malloc(static_cast<size_t>(n), kDirectAlignment));
+#else
+  void *p = NULL;
+  if (posix_memalign(&p, kDirectAlignment, static_cast<size_t>(n)) != 0) {
+    return NULL;
+  }
+  return static_cast<uint8_t *>(p);
+#endif
+}
+
+static void FreeAligned(uint8_t *p) {
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+struct FileSink;
+static void WriteChunk(FileSink &sink);
+
+#ifdef _WIN32
+static DWORD WINAPI WriteThreadMain(LPVOID arg) {
+  WriteChunk(*reinterpret_cast<FileSink *>(arg));
+  return 0;
+}
+#else
+static void *WriteThreadMain(void *arg) {
+  WriteChunk(*reinterpret_cast<FileSink *>(arg));
+  return NULL;
+}
+#endif
+
+struct FileSink {
+  uint8_t *buffers[2];
+  uint8_t *begin;  // Buffer being filled
+  uint8_t *limit;  // End of the chunk in `begin`
+  uint64_t chunk_size;
+  uint64_t position;  // File offset of `begin`
+
+  // Write in flight.
+  void *thread;  // Opaque thread handle. NULL if none.
+  const uint8_t *pending;
+  uint64_t pending_size;
+  uint64_t pending_offset;
+
+  // Checksums of objects whose slot was written before they were closed.
+  std::vector<std::pair<uint64_t, uint32_t> > patches;
+
+#ifdef _WIN32
+  HANDLE file;
+#else
+  int fd;
+  char pad4_[4];
+#endif
+  bool direct;  // Page cache is bypassed.
+  bool failed;  // A write failed.
+  char pad6_[6];
+
+  explicit FileSink(uint64_t size)
+      : begin(NULL),
+        limit(NULL),
+        chunk_size(size),
+        position(0),
+        thread(NULL),
+        pending(NULL),
+        pending_size(0),
+        pending_offset(0),
+#ifdef _WIN32
+        file(INVALID_HANDLE_VALUE),
+#else
+        fd(-1),
+#endif
+        direct(false),
+        failed(false) {
+    // Room for the slack and the padding of the last chunk.
+    buffers[0] = AllocateAligned(chunk_size + kDirectAlignment);
+    buffers[1] = AllocateAligned(chunk_size + kDirectAlignment);
+    if (buffers[0] && buffers[1]) {
+      begin = buffers[0];
+      limit = begin + chunk_size;
+    }
+  }
+
+  ~FileSink() {
+    WaitWrite();
+    Close();
+    FreeAligned(buffers[0]);
+    FreeAligned(buffers[1]);
+  }
+
+  bool Open(const char *filename, bool bypass_cache) {
+#ifdef _WIN32
+    if (bypass_cache) {
+      file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                         CREATE_ALWAYS,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, NULL);
+      direct = (file != INVALID_HANDLE_VALUE);
+    }
+    if (file == INVALID_HANDLE_VALUE) {
+      file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                         CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    return (file != INVALID_HANDLE_VALUE);
+#else
+    int flags = O_RDWR | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+    if (bypass_cache) {
+      fd = open(filename, flags | O_DIRECT, 0644);
+      direct = (fd != -1);
+    }
+#endif
+    if (fd == -1) {
+      fd = open(filename, flags, 0644);
+    }
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    if ((fd != -1) && bypass_cache) {
+      direct = (fcntl(fd, F_NOCACHE, 1) != -1);
+    }
+#endif
+    return (fd != -1);
+#endif
+  }
+
+  void Close() {
+#ifdef _WIN32
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+#else
+    if ((fd != -1) && (close(fd) != 0)) failed = true;
+    fd = -1;
+#endif
+  }
+
+  bool WriteAt(const uint8_t *p, uint64_t n, uint64_t offset) {
+    while (n > 0) {
+#ifdef _WIN32
+      OVERLAPPED ov;
+      memset(&ov, 0, sizeof(ov));
+      ov.Offset = static_cast<DWORD>(offset);
+      ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+      DWORD k = 0;
+      DWORD len = static_cast<DWORD>(std::min(n, UINT64_C(1) << 30));
+      if (!::WriteFile(file, p, len, &k, &ov) || (k == 0)) {
+        return false;
+      }
+#else
+      ssize_t k = pwrite(fd, p, static_cast<size_t>(n),
+                         static_cast<off_t>(offset));
+      if (k < 0) {
+        if (errno == EINTR) continue;
+#if defined(O_DIRECT)
+        if ((errno == EINVAL) && direct) {
+          // File system does not take direct I/O. Write through the page
+          // cache instead.
+          int flags = fcntl(fd, F_GETFL);
+          if ((flags != -1) && (fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0)) {
+            direct = false;
+            continue;
+          }
+        }
+#endif
+        return false;
+      }
+#endif
+      p += k;
+      n -= static_cast<uint64_t>(k);
+      offset += static_cast<uint64_t>(k);
+    }
+    return true;
+  }
+
+  bool ReadAt(uint8_t *p, uint64_t n, uint64_t offset) {
+    while (n > 0) {
+#ifdef _WIN32
+      OVERLAPPED ov;
+      memset(&ov, 0, sizeof(ov));
+      ov.Offset = static_cast<DWORD>(offset);
+      ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+      DWORD k = 0;
+      if (!ReadFile(file, p, static_cast<DWORD>(n), &k, &ov) || (k == 0)) {
+        return false;
+      }
+#else
+      ssize_t k = pread(fd, p, static_cast<size_t>(n),
+                        static_cast<off_t>(offset));
+      if ((k < 0) && (errno == EINTR)) continue;
+      if (k <= 0) return false;
+#endif
+      p += k;
+      n -= static_cast<uint64_t>(k);
+      offset += static_cast<uint64_t>(k);
+    }
+    return true;
+  }
+
+  // Keep dirty and cached pages of buffered writes bounded: start writeback
+  // of the chunk at `offset`, then wait for the previous one and drop it.
+  void DropCache(uint64_t offset, uint64_t n) {
+#if defined(SYNC_FILE_RANGE_WRITE) && defined(POSIX_FADV_DONTNEED)
+    if (direct) return;
+    sync_file_range(fd, static_cast<off_t>(offset), static_cast<off_t>(n),
+                    SYNC_FILE_RANGE_WRITE);
+    if (offset >= chunk_size) {
+      off_t prev = static_cast<off_t>(offset - chunk_size);
+      sync_file_range(fd, prev, static_cast<off_t>(chunk_size),
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(fd, prev, static_cast<off_t>(chunk_size),
+                    POSIX_FADV_DONTNEED);
+    }
+#else
+    (void)offset;
+    (void)n;
+#endif
+  }
+
+  // Write [p, p + n) at `offset` in the background.
+  void StartWrite(const uint8_t *p, uint64_t n, uint64_t offset) {
+    WaitWrite();
+    pending = p;
+    pending_size = n;
+    pending_offset = offset;
+
+#ifdef _WIN32
+    HANDLE handle = CreateThread(NULL, 0, WriteThreadMain, this, 0, NULL);
+    if (handle != NULL) {
+      thread = handle;
+      return;
+    }
+#else
+    pthread_t *handle = new pthread_t;
+    if (pthread_create(handle, NULL, WriteThreadMain, this) == 0) {
+      thread = handle;
+      return;
+    }
+    delete handle;
+#endif
+    WriteChunk(*this);  // No thread. Write synchronously.
+  }
+
+  void WaitWrite() {
+    if (!thread) {
+      return;
+    }
+#ifdef _WIN32
+    HANDLE handle = reinterpret_cast<HANDLE>(thread);
+    WaitForSingleObject(handle, INFINITE);
+    CloseHandle(handle);
+#else
+    pthread_t *handle = reinterpret_cast<pthread_t *>(thread);
+    pthread_join(*handle, NULL);
+    delete handle;
+#endif
+    thread = NULL;
+  }
+
+  uint64_t Tell(const uint8_t *p) const {
+    return position + static_cast<uint64_t>(p - begin);
+  }
+
+  // Hand the full chunk to the writer thread and continue in the other
+  // buffer. Checksums of open objects take the chunk first, since the buffer
+  // is reused.
+  uint8_t *Handoff(std::vector<ChecksumScope> &scopes, uint8_t *p) {
+    for (size_t i = 0; i < scopes.size(); i++) {
+      if (scopes[i].from) {
+        scopes[i].crc = CRC32C(scopes[i].crc, scopes[i].from,
+                               static_cast<uint64_t>(p - scopes[i].from));
+      }
+    }
+
+    uint8_t *next = (begin == buffers[0]) ? buffers[1] : buffers[0];
+    size_t over = static_cast<size_t>(p - limit);
+    WaitWrite();  // `next` was written last.
+    memcpy(next, limit, over);
+    if (!failed) {
+      StartWrite(begin, chunk_size, position);
+    }
+    position += chunk_size;
+    begin = next;
+    limit = next + chunk_size;
+    p = next + over;
+
+    for (size_t i = 0; i < scopes.size(); i++) {
+      if (scopes[i].from) scopes[i].from = p;
+    }
+    return p;
+  }
+
+  // Store the checksum of an object at file offset `pos`.
+  void Patch(uint64_t pos, uint32_t crc) {
+    if (pos >= position) {
+      memcpy(begin + (pos - position), &crc, sizeof(uint32_t));
+    } else {
+      patches.push_back(std::make_pair(pos, crc));
+    }
+  }
+
+  // Write the rest and close the file. Returns error string.
+  std::string Finish(uint8_t *p) {
+    uint64_t n = static_cast<uint64_t>(p - begin);
+    uint64_t total = position + n;
+    WaitWrite();
+
+    // Direct I/O writes whole blocks. The file is truncated afterwards.
+    uint64_t padded = direct ? AlignUp(n, kDirectAlignment) : n;
+    memset(begin + n, 0, static_cast<size_t>(padded - n));
+    if (!failed && (padded > 0)) {
+      pending = begin;
+      pending_size = padded;
+      pending_offset = position;
+      WriteChunk(*this);
+    }
+
+    // Checksums of objects which span chunks.
+    uint8_t *block = buffers[0];
+    for (size_t i = 0; (i < patches.size()) && !failed; i++) {
+      uint64_t pos = patches[i].first;
+      const uint32_t &crc = patches[i].second;
+      if (direct) {
+        uint64_t first = pos / kDirectAlignment * kDirectAlignment;
+        uint64_t len = AlignUp(pos + sizeof(uint32_t), kDirectAlignment) - first;
+        if (!ReadAt(block, len, first)) failed = true;
+        memcpy(block + (pos - first), &crc, sizeof(uint32_t));
+        if (!failed && !WriteAt(block, len, first)) failed = true;
+      } else if (!WriteAt(reinterpret_cast<const uint8_t *>(&crc),
+                          sizeof(uint32_t), pos)) {
+        failed = true;
+      }
+    }
+
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    size.QuadPart = static_cast<LONGLONG>(total);
+    if (!SetFilePointerEx(file, size, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(file)) {
+      failed = true;
+    }
+#else
+    if (ftruncate(fd, static_cast<off_t>(total)) != 0) failed = true;
+#if defined(SYNC_FILE_RANGE_WRITE) && defined(POSIX_FADV_DONTNEED)
+    if (!direct) {
+      sync_file_range(fd, 0, 0,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+#endif
+#endif
+    Close();
+
+    return failed ? "Failed to write.\n" : "";
+  }
+
+ private:
+  FileSink(const FileSink &);
+  FileSink &operator=(const FileSink &);
+};
+
+static void WriteChunk(FileSink &sink) {
+  if (!sink.WriteAt(sink.pending, sink.pending_size, sink.pending_offset)) {
+    sink.failed = true;
+    return;
+  }
+  sink.DropCache(sink.pending_offset, sink.pending_size);
+}
+
+struct SerializeState {
+  std::vector<ChecksumScope> scopes;
+
+  // Output to a file in chunks. NULL when serializing to memory.
+  FileSink *sink;
+
+  // Compact encoding and deduplication
+  std::vector<uint64_t> sizes;  // Content size of objects and arrays.
+  size_t size_index;
+  int depth;
+  bool compact;
+  bool dedup;
+  char pad2_[2];
+
+  // Deduplication. Binaries which may be deduplicated are numbered in the
+  // order they are serialized. `binary_refs` holds the number of the
+  // original for a duplicate and -1 otherwise, and `binary_offsets` the
+  // payload offset of each binary written so far.
+  std::vector<int64_t> binary_refs;
+  std::vector<uint64_t> binary_offsets;
+  size_t binary_index;
+  const uint8_t *document;  // Start of the output in memory.
+
+  // Originals by address, and by payload size and CRC32C. The first payload
+  // of each size is only hashed once another payload of that size shows up,
+  // so binaries of unique sizes are never read.
+  struct DedupEntry {
+    const Value *value;  // NULL once hashed.
+    size_t index;
+  };
+  typedef std::pair<const uint8_t *, uint64_t> Address;
+  typedef std::pair<uint64_t, uint32_t> Digest;  // size + CRC32C
+  std::map<Address, size_t> by_address;
+  std::map<uint64_t, DedupEntry> first_of_size;
+  std::map<Digest, std::vector<DedupEntry> > by_digest;
+
+  SerializeState()
+      : sink(NULL),
+        size_index(0),
+        depth(0),
+        compact(false),
+        dedup(false),
+        binary_index(0),
+        document(NULL) {}
+
+  // Serialize `v` as a document.
+  uint8_t *Run(const Value &v, uint8_t *p) {
+    document = p;
+    if (compact || dedup) v.ComputeEncodedSize(*this, true);
+    return v.Serialize(p, *this);
+  }
+
+  // Offset of `p` from the start of the document.
+  uint64_t Tell(const uint8_t *p) const {
+    return sink ? sink->Tell(p) : static_cast<uint64_t>(p - document);
+  }
+
+  static bool IsDedupCandidate(const Value &v) {
+    return v.IsBinary() && !v.checksum_ && (v.size_ >= kMinDedupSize);
+  }
+
+  // Number the binary `v` and return the number of its original, or -1 if
+  // `v` is the first binary with this payload.
+  int64_t FindOriginal(const Value &v) {
+    size_t index = binary_refs.size();
+    DedupEntry entry;
+    entry.value = &v;
+    entry.index = index;
+
+    // Values sharing memory are identical.
+    std::pair<std::map<Address, size_t>::iterator, bool> address =
+        by_address.insert(
+            std::make_pair(Address(v.binary_.ptr, v.size_), index));
+    if (!address.second) {
+      binary_refs.push_back(static_cast<int64_t>(address.first->second));
+      return binary_refs.back();
+    }
+
+    std::pair<std::map<uint64_t, DedupEntry>::iterator, bool> first =
+        first_of_size.insert(std::make_pair(v.size_, entry));
+    if (first.second) {
+      binary_refs.push_back(-1);  // First payload of this size.
+      return -1;
+    }
+    DedupEntry &pending = first.first->second;
+    if (pending.value) {
+      const Value &p = *pending.value;
+      by_digest[Digest(p.size_, CRC32C(0, p.binary_.ptr, p.size_))].push_back(
+          pending);
+      pending.value = NULL;
+    }
+
+    // Matching CRCs are verified byte by byte.
+    std::vector<DedupEntry> &entries =
+        by_digest[Digest(v.size_, CRC32C(0, v.binary_.ptr, v.size_))];
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (memcmp(entries[i].value->binary_.ptr, v.binary_.ptr,
+                 static_cast<size_t>(v.size_)) == 0) {
+        address.first->second = entries[i].index;
+        binary_refs.push_back(static_cast<int64_t>(entries[i].index));
+        return binary_refs.back();
+      }
+    }
+    entries.push_back(entry);
+    binary_refs.push_back(-1);
+    return -1;
+  }
+
+  // Tag of `v` as an element. Duplicates are written as references.
+  char ElementTag(const Value &v) const {
+    if (dedup && IsDedupCandidate(v) &&
+        (binary_refs[binary_index] >= 0)) {
+      return BINARY_REF_TYPE;
+    }
+    return v.Tag();
+  }
+};
+
+// Make kChunkSlack bytes available at `p`. When writing to a file, a full
+// chunk is handed off first.
+static uint8_t *Room(SerializeState &state, uint8_t *p) {
+  if (state.sink && (p >= state.sink->limit)) {
+    return state.sink->Handoff(state.scopes, p);
+  }
+  return p;
+}
+
+static uint8_t *WriteBytes(SerializeState &state, uint8_t *p,
+                           const uint8_t *src, uint64_t n) {
+  if (!state.sink) {
+    if (n > 0) memcpy(p, src, static_cast<size_t>(n));
+    return p + n;
+  }
+  while (n > 0) {
+    p = Room(state, p);
+    size_t k = static_cast<size_t>(std::min(
+        n, static_cast<uint64_t>(state.sink->limit + kChunkSlack - p)));
+    memcpy(p, src, k);
+    p += k;
+    src += k;
+    n -= k;
+  }
+  return p;
+}
+
+// Exclude bytes written between these calls from object checksums.
+static void PauseChecksums(std::vector<ChecksumScope> &scopes,
+                           const uint8_t *p) {
+  for (size_t i = 0; i < scopes.size(); i++) {
+    scopes[i].crc = CRC32C(scopes[i].crc, scopes[i].from,
+                           static_cast<uint64_t>(p - scopes[i].from));
+    scopes[i].from = NULL;
+  }
+}
+
+static void ResumeChecksums(std::vector<ChecksumScope> &scopes,
+                            const uint8_t *p) {
+  for (size_t i = 0; i < scopes.size(); i++) {
+    scopes[i].from = p;
+  }
+}
+
+
+uint64_t Value::ComputeEncodedSize(SerializeState &state, bool root) const {
+  bool compact = state.compact;
+  if (!root && !state.dedup && CanReuseSource(compact)) {
+    return source_size_;  // Copied as is. No sizes are consumed.
+  }
+
+  switch (type_) {
+    case NULL_TYPE:
+      return 0;
+    case BOOL_TYPE:
+      return 1;
+    case FLOAT64_TYPE:
+      return sizeof(double);
+    case INT64_TYPE:
+      return compact ? VarintSize(ZigZagEncode(int64_)) : sizeof(int64_t);
+    case STRING_TYPE:
+      return LengthSize(string_->size(), compact) + string_->size();
+    case BINARY_TYPE:
+      if (checksum_) {
+        return LengthSize(size_, compact) +
+               LengthSize(checksum_block_size_, compact) +
+               NumChecksumBlocks() * sizeof(uint32_t) + size_;
+      }
+      if (state.dedup && SerializeState::IsDedupCandidate(*this) &&
+          (state.FindOriginal(*this) >= 0)) {
+        return sizeof(int64_t) + LengthSize(size_, compact);  // offset + N
+      }
+      return LengthSize(size_, compact) + size_;
+    case OBJECT_TYPE: {
+      size_t slot = state.sizes.size();
+      state.sizes.push_back(0);
+
+      uint64_t content = 0;
+      if (checksum_) {
+        content += 1 + 1 + sizeof(uint32_t);  // tag + "" + crc
+      }
+      for (Object::const_iterator it = object_->begin(); it != object_->end();
+           ++it) {
+        content += 1 + it->first.size() + 1;  // tag + key + '\0'
+        content += it->second.ComputeEncodedSize(state, false);
+      }
+      state.sizes[slot] = content;
+
+      // Compact toplevel has a fixed size header to mark the encoding.
+      return ((root || !compact) ? sizeof(int64_t) : VarintSize(content)) +
+             content;
+    }
+    case ARRAY_TYPE: {
+      size_t slot = state.sizes.size();
+      state.sizes.push_back(0);
+
+      if (columnar_) {
+        uint64_t columns_size = ComputeColumnsSize();
+        if (columns_size > 0) {
+          state.sizes[slot] = columns_size;
+          return LengthSize(columns_size, compact) + columns_size;
+        }
+      }
+
+      LoadRows();
+      uint64_t content = 0;
+      for (size_t i = 0; i < array_->size(); i++) {
+        content += 1 + (*array_)[i].ComputeEncodedSize(state, false);  // tag
+      }
+      state.sizes[slot] = content;
+
+      return LengthSize(content, compact) + content;
+    }
+    default:
+      assert(0);
+      break;
+  }
+  return 0;  // Never come here.
+}
+
+uint64_t Value::Size(const SerializeOption &option) const {
+  if ((option.encoding == ENCODING_COMPACT) || option.dedup_binary) {
+    SerializeState state;
+    state.compact = (option.encoding == ENCODING_COMPACT);
+    state.dedup = option.dedup_binary;
+    return ComputeEncodedSize(state, true);
+  }
+  return Size();
+}
+
+void Value::Freeze() const {
+  // Function-local statics are initialized on first use. Do it now so that
+  // readers never race on the initialization.
+  NullValue();
+  Shared<std::string>().Get();
+  Shared<Array>().Get();
+  Shared<Object>().Get();
+
+  if (IsArray()) {
+    LoadRows();
+    for (size_t i = 0; i < array_->size(); i++) {
+      (*array_)[i].Freeze();
+    }
+  } else if (IsObject()) {
+    for (Object::const_iterator it = object_->begin(); it != object_->end();
+         ++it) {
+      it->second.Freeze();
+    }
+  } else {
+    return;
+  }
+
+  Size();
+}
+
+uint8_t *Value::Serialize(uint8_t *p) const {
+  SerializeState state;
+  return Serialize(p, state);
+}
+
+uint8_t *Value::Serialize(uint8_t *p, const SerializeOption &option) const {
+  SerializeState state;
+  state.compact = (option.encoding == ENCODING_COMPACT);
+  state.dedup = option.dedup_binary;
+  return state.Run(*this, p);
+}
+
+uint8_t *Value::Serialize(uint8_t *p, SerializeState &state) const {
+  // Compact encoding has a different header at the toplevel.
+  // Offsets of deduplicated payloads change, so sources are not reused then.
+  if (((state.depth > 0) || !state.compact) && !state.dedup &&
+      CanReuseSource(state.compact)) {
+    return WriteBytes(state, p, source_ptr_, source_size_);
+  }
+
+  // Fields up to kChunkSlack bytes are written after a `Room` check.
+  uint8_t *ptr = Room(state, p);
+  switch (type_) {
+    case BOOL_TYPE:
+      (*ptr) = boolean_ ? 1 : 0;
+      ptr++;
+      break;
+    case FLOAT64_TYPE:
+      memcpy(ptr, &float64_, sizeof(double));
+      ptr += sizeof(double);
+      break;
+    case INT64_TYPE: {
+      if (state.compact) {
+        ptr = WriteVarint(ptr, ZigZagEncode(int64_));
+        break;
+      }
+      // (*(reinterpret_cast<int64_t *>(ptr))) = int64_;
+      memcpy(ptr, &int64_, sizeof(int64_t));
+      ptr += sizeof(int64_t);
+    } break;
+    case STRING_TYPE: {
+      // len(64bit or varint) + string
+      ptr = WriteLength(ptr, string_->size(), state.compact);
+      ptr = WriteBytes(state, ptr,
+                       reinterpret_cast<const uint8_t *>(string_->data()),
+                       string_->size());
+    } break;
+    case BINARY_TYPE: {
+      if (state.dedup && SerializeState::IsDedupCandidate(*this)) {
+        int64_t ref = state.binary_refs[state.binary_index++];
+        if (ref >= 0) {
+          // offset(64bit) + len(64bit or varint)
+          uint64_t offset = state.binary_offsets[static_cast<size_t>(ref)];
+          memcpy(ptr, &offset, sizeof(int64_t));
+          ptr = WriteLength(ptr + sizeof(int64_t), size_, state.compact);
+          state.binary_offsets.push_back(offset);
+          break;
+        }
+        ptr = WriteLength(ptr, size_, state.compact);
+        state.binary_offsets.push_back(state.Tell(ptr));
+        ptr = WriteBytes(state, ptr, binary_.ptr, size_);
+        break;
+      }
+
+      // len(64bit or varint) + bindata
+      ptr = WriteLength(ptr, size_, state.compact);
+
+      if (checksum_ && state.sink) {
+        // The table precedes the data, which may not fit in the chunk.
+        ptr = WriteLength(ptr, checksum_block_size_, state.compact);
+        std::vector<uint8_t> table(
+            static_cast<size_t>(NumChecksumBlocks() * sizeof(uint32_t)));
+        for (uint64_t offset = 0, b = 0; offset < size_;
+             offset += checksum_block_size_, b++) {
+          uint32_t crc = CRC32C(0, binary_.ptr + offset,
+                                std::min(checksum_block_size_, size_ - offset));
+          memcpy(&table[static_cast<size_t>(b * sizeof(uint32_t))], &crc,
+                 sizeof(uint32_t));
+        }
+        if (!table.empty()) {
+          ptr = WriteBytes(state, ptr, &table[0], table.size());
+        }
+        PauseChecksums(state.scopes, ptr);
+        ptr = WriteBytes(state, ptr, binary_.ptr, size_);
+        ResumeChecksums(state.scopes, ptr);
+      } else if (checksum_) {
+        // block size(64bit or varint) + CRC32C per block + bindata
+        ptr = WriteLength(ptr, checksum_block_size_, state.compact);
+
+        uint8_t *table = ptr;
+        uint8_t *data = table + NumChecksumBlocks() * sizeof(uint32_t);
+        for (uint64_t offset = 0, b = 0; offset < size_;
+             offset += checksum_block_size_, b++) {
+          size_t n = static_cast<size_t>(
+              std::min(checksum_block_size_, size_ - offset));
+          // Checksum while the block is hot in cache.
+          uint32_t crc = CRC32C(0, binary_.ptr + offset, n);
+          memcpy(table + b * sizeof(uint32_t), &crc, sizeof(uint32_t));
+          memcpy(data + offset, binary_.ptr + offset, n);
+        }
+        SkipChecksumRange(state.scopes, data, data + size_);
+        ptr = data + size_;
+      } else {
+        ptr = WriteBytes(state, ptr, binary_.ptr, size_);
+      }
+    } break;
+    case OBJECT_TYPE: {
+      uint8_t *begin = ptr;
+      if (!state.compact) {
+        // Total size of the object including this header.
+        uint64_t object_size =
+            state.dedup ? sizeof(int64_t) + state.sizes[state.size_index++]
+                        : Size();
+        memcpy(ptr, &object_size, sizeof(int64_t));
+        ptr += sizeof(int64_t);
+      } else if (state.depth == 0) {
+        // Total size with the encoding mark.
+        uint64_t content = state.sizes[state.size_index++];
+        uint64_t header = (sizeof(int64_t) + content) | kCompactHeader;
+        memcpy(ptr, &header, sizeof(int64_t));
+        ptr += sizeof(int64_t);
+      } else {
+        // Size of the content.
+        ptr = WriteVarint(ptr, state.sizes[state.size_index++]);
+      }
+      uint8_t *header_end = ptr;
+
+      // Checksum element comes first so that a reader knows it before
+      // reading the object.
+      uint8_t *crc_slot = NULL;
+      uint64_t crc_slot_pos = 0;
+      if (checksum_) {
+        uint8_t *element = ptr;
+        (*ptr++) = CRC32C_TYPE;
+        (*ptr++) = '\0';  // empty key
+        crc_slot = ptr;
+        if (state.sink) crc_slot_pos = state.sink->Tell(ptr);
+        memset(ptr, 0, sizeof(uint32_t));
+        ptr += sizeof(uint32_t);
+
+        SkipChecksumRange(state.scopes, element, ptr);
+
+        ChecksumScope scope;
+        scope.crc =
+            CRC32C(0, begin, static_cast<uint64_t>(header_end - begin));
+        scope.from = ptr;
+        scope.stored = 0;
+        state.scopes.push_back(scope);
+      }
+
+      state.depth++;
+
+      // Serialize key-value pairs.
+      for (Object::const_iterator it = object_->begin(); it != object_->end();
+           ++it) {
+        // Emit type tag.
+        ptr = Room(state, ptr);
+        char ty = state.ElementTag(it->second);
+        (*(reinterpret_cast<char *>(ptr))) = ty;
+        ptr++;
+
+        // Emit key(null terminated)
+        const std::string &key = it->first;
+        ptr = WriteBytes(state, ptr,
+                         reinterpret_cast<const uint8_t *>(key.c_str()),
+                         key.size() + 1);
+
+        // Emit element
+        ptr = it->second.Serialize(ptr, state);
+      }
+
+      state.depth--;
+
+      if (crc_slot) {
+        uint32_t crc = CloseChecksumScope(state.scopes, ptr);
+        if (state.sink) {
+          state.sink->Patch(crc_slot_pos, crc);  // May be written already.
+        } else {
+          memcpy(crc_slot, &crc, sizeof(uint32_t));
+        }
+      }
+    } break;
+    case ARRAY_TYPE: {
+      if (state.compact) {
+        // Size of the content.
+        ptr = WriteVarint(ptr, state.sizes[state.size_index++]);
+      } else {
+        // Total size of the array including this header.
+        uint64_t array_size =
+            state.dedup ? sizeof(int64_t) + state.sizes[state.size_index++]
+                        : Size();
+        memcpy(ptr, &array_size, sizeof(int64_t));
+        ptr += sizeof(int64_t);
+      }
+
+      if (columnar_ && (ComputeColumnsSize() > 0)) {
+        ptr = SerializeColumns(ptr, state);
+        break;
+      }
+
+      // Elements are tag + data. No keys.
+      LoadRows();
+      state.depth++;
+      for (size_t i = 0; i < array_->size(); i++) {
+        ptr = Room(state, ptr);
+        (*ptr++) = static_cast<uint8_t>(state.ElementTag((*array_)[i]));
+        ptr = (*array_)[i].Serialize(ptr, state);
+      }
+      state.depth--;
+    } break;
+    case NULL_TYPE:
+      break;
+    default:
+      assert(0);
+      break;
+  }
+
+  return ptr;
+}
+
+uint8_t *Value::SerializeColumns(uint8_t *p, SerializeState &state) const {
+  const Array &rows = *array_;
+  const Object &schema = *(rows[0].object_);
+
+  // Walk all rows in step. Their keys are in the same order.
+  std::vector<Object::const_iterator> cursors(rows.size());
+  for (size_t r = 0; r < rows.size(); r++) {
+    cursors[r] = rows[r].object_->begin();
+  }
+
+  // Column sizes come first in the schema.
+  std::vector<uint64_t> column_sizes;
+  for (Object::const_iterator it = schema.begin(); it != schema.end(); ++it) {
+    uint64_t stride = ColumnStride(it->second.Tag());
+    uint64_t column_size = stride ? (rows.size() * stride)
+                                  : ((rows.size() + 1) * sizeof(int64_t));
+    for (size_t r = 0; r < rows.size(); r++) {
+      const Value &v = (cursors[r]++)->second;
+      if (v.IsString()) {
+        column_size += v.string_->size();
+      } else if (v.IsBinary()) {
+        column_size += v.size_;
+      }
+    }
+    column_sizes.push_back(column_size);
+  }
+
+  p = Room(state, p);
+  int64_t num_rows = static_cast<int64_t>(rows.size());
+  int64_t num_fields = static_cast<int64_t>(schema.size());
+  memcpy(p, &num_rows, sizeof(int64_t));
+  memcpy(p + sizeof(int64_t), &num_fields, sizeof(int64_t));
+  p += 2 * sizeof(int64_t);
+
+  size_t f = 0;
+  for (Object::const_iterator it = schema.begin(); it != schema.end();
+       ++it, f++) {
+    p = Room(state, p);
+    (*p++) = static_cast<uint8_t>(it->second.Tag());
+    p = WriteBytes(state, p,
+                   reinterpret_cast<const uint8_t *>(it->first.c_str()),
+                   it->first.size() + 1);  // Includes '\0'
+    p = Room(state, p);
+    memcpy(p, &column_sizes[f], sizeof(int64_t));
+    p += sizeof(int64_t);
+  }
+
+  for (size_t r = 0; r < rows.size(); r++) {
+    cursors[r] = rows[r].object_->begin();
+  }
+
+  for (f = 0; f < column_sizes.size(); f++) {
+    switch (cursors[0]->second.Type()) {
+      case BOOL_TYPE:
+        for (size_t r = 0; r < rows.size(); r++) {
+          p = Room(state, p);
+          (*p++) = cursors[r]->second.boolean_ ? 1 : 0;
+        }
+        break;
+      case INT64_TYPE:
+        for (size_t r = 0; r < rows.size(); r++) {
+          p = Room(state, p);
+          memcpy(p, &cursors[r]->second.int64_, sizeof(int64_t));
+          p += sizeof(int64_t);
+        }
+        break;
+      case FLOAT64_TYPE:
+        for (size_t r = 0; r < rows.size(); r++) {
+          p = Room(state, p);
+          memcpy(p, &cursors[r]->second.float64_, sizeof(double));
+          p += sizeof(double);
+        }
+        break;
+      case STRING_TYPE:
+      case BINARY_TYPE: {
+        // Offsets, then bytes of all rows.
+        uint64_t offset = 0;
+        for (size_t r = 0; r <= rows.size(); r++) {
+          p = Room(state, p);
+          memcpy(p, &offset, sizeof(int64_t));
+          p += sizeof(int64_t);
+          if (r == rows.size()) break;
+          const Value &v = cursors[r]->second;
+          offset += v.IsString() ? v.string_->size() : v.size_;
+        }
+        for (size_t r = 0; r < rows.size(); r++) {
+          const Value &v = cursors[r]->second;
+          if (v.IsString()) {
+            p = WriteBytes(state, p,
+                           reinterpret_cast<const uint8_t *>(v.string_->data()),
+                           v.string_->size());
+          } else {
+            p = WriteBytes(state, p, v.binary_.ptr, v.size_);
+          }
+        }
+      } break;
+      default:
+        assert(0);
+        break;
+    }
+
+    for (size_t r = 0; r < rows.size(); r++) {
+      ++cursors[r];
+    }
+  }
+
+  return p;
+}
+
+std::string SaveFile(const char *filename, const Value &v,
+                     const SaveOption &option) {
+  uint64_t chunk_size = std::max(
+      AlignUp(option.buffer_size, kDirectAlignment), kMinChunkSize);
+  FileSink sink(chunk_size);
+  if (!sink.begin) {
+    return "Failed to allocate buffers.\n";
+  }
+  if (!sink.Open(filename, option.direct)) {
+    return "Failed to open `" + std::string(filename) + "`.\n";
+  }
+
+  SerializeState state;
+  state.sink = &sink;
+  state.compact = (option.serialize.encoding == ENCODING_COMPACT);
+  state.dedup = option.serialize.dedup_binary;
+  uint8_t *end = state.Run(v, sink.begin);
+
+  return sink.Finish(end);
+}
+
+struct ParseState {
+  std::stringstream err;
+  ParseOption option;
+  std::vector<ChecksumScope> scopes;
+  const uint8_t *document;  // Binary references are offsets from here.
+  // Checksum elements, checksummed binaries and binary references read.
+  // Source bytes containing them can't be copied as is: enclosing checksums
+  // skip some of them, and references are positions in the document.
+  size_t num_uncopyable;
+  bool compact;          // Compact encoding
+  char pad7_[7];
+
+  ParseState() : document(NULL), num_uncopyable(0), compact(false) {}
+
+  static void SetChecksumTable(Value &v, const uint8_t *table) {
+    v.checksum_table_ = table;
+  }
+
+  bool KeepSource() const {
+    return option.keep_source || !option.buffer.Empty();
+  }
+
+  // Rows are decoded from [columns, end) on first access if the source is
+  // kept. Otherwise the data may change after parsing, so decode them now.
+  void SetColumns(Value &v, const uint8_t *columns, const uint8_t *end) const {
+    v.columnar_ = true;
+    v.columns_ = columns;
+    v.columns_end_ = end;
+    v.rows_pending_ = true;
+    if (!KeepSource()) v.DecodeRows();
+  }
+
+  // Remember source bytes so that an unmodified value can be copied as is.
+  void SetSource(Value &v, const uint8_t *begin, const uint8_t *end,
+                 size_t num_uncopyable_before) const {
+    if (!KeepSource()) return;
+    v.source_ptr_ = begin;
+    v.source_size_ = static_cast<uint64_t>(end - begin);
+    v.source_buffer_ = option.buffer;
+    v.source_compact_ = compact;
+    v.source_uncopyable_ = (num_uncopyable != num_uncopyable_before);
+    v.modified_ = false;
+    v.dirty_ = true;
+  }
+};
+
+// Forward decl.
+static const uint8_t *ParseElement(ParseState &state, Object &o,
+                                   const uint8_t *p, const uint8_t *end);
+static const uint8_t *ReadValue(ParseState &state, Type type,
+                                const std::string &key, Value &v,
+                                const uint8_t *ptr, const uint8_t *end);
+
+// Check if `n` bytes are available at `p`.
+static bool CheckRemaining(ParseState &state, const std::string &key,
+                           const uint8_t *p, const uint8_t *end, int64_t n) {
+  if ((n < 0) || (n > end - p)) {
+    state.err << "Invalid length for `" << key << "`(" << n << " bytes, "
+              << (end - p) << " bytes remaining).\n";
+    return false;
+  }
+  return true;
+}
+
+// Read a length. Returns NULL on error.
+static const uint8_t *ReadLength(ParseState &state, const std::string &key,
+                                 int64_t &n, const uint8_t *p,
+                                 const uint8_t *end) {
+  if (state.compact) {
+    uint64_t v;
+    p = ReadVarint(p, end, v);
+    if (!p || (v > kHeaderSizeMask)) {
+      state.err << "Invalid length for `" << key << "`.\n";
+      return NULL;
+    }
+    n = static_cast<int64_t>(v);
+    return p;
+  }
+
+  if (!CheckRemaining(state, key, p, end, sizeof(int64_t))) {
+    return NULL;
+  }
+  memcpy(&n, p, sizeof(int64_t));
+  return p + sizeof(int64_t);
+}
+
+static const uint8_t *ReadKey(std::string &key, const uint8_t *p) {
+  key = std::string(reinterpret_cast<const char *>(p));
+
+  p += key.length() + 1;  // + '\0'
+
+  return p;
+}
+
+static const uint8_t *ReadFloat64(double &v, const uint8_t *p) {
+  double val = 0.0;
+  memcpy(&val, p, sizeof(double));
+  v = val;
+  p += sizeof(double);
+
+  return p;
+}
+
+static const uint8_t *ReadInt64(int64_t &v, const uint8_t *p) {
+  int64_t val = 0;
+  memcpy(&val, p, sizeof(int64_t));
+  v = val;
+  p += sizeof(int64_t);
+
+  return p;
+}
+
+// Read the header of an object or array. Sets `content_end` to the end of
+// its elements. Returns NULL on error.
+static const uint8_t *ReadContainerHeader(ParseState &state,
+                                          const std::string &key, bool root,
+                                          const uint8_t *p, const uint8_t *end,
+                                          const uint8_t *&content_end) {
+  const uint8_t *begin = p;
+  if (state.compact && !root) {
+    // N(varint) + data. N is the size of data.
+    int64_t n;
+    p = ReadLength(state, key, n, p, end);
+    if (!p || !CheckRemaining(state, key, p, end, n)) {
+      return NULL;
+    }
+    content_end = p + n;
+  } else {
+    // N + data. N is the total size including N itself.
+    if (!CheckRemaining(state, key, p, end, sizeof(int64_t))) {
+      return NULL;
+    }
+    int64_t n;
+    p = ReadInt64(n, p);
+    if (state.compact) {
+      n = static_cast<int64_t>(static_cast<uint64_t>(n) & kHeaderSizeMask);
+    }
+
+    if ((n < static_cast<int64_t>(sizeof(int64_t))) ||
+        !CheckRemaining(state, key, begin, end, n)) {
+      state.err << "Invalid size for `" << key << "`.\n";
+      return NULL;
+    }
+    content_end = begin + n;
+  }
+  return p;
+}
+
+static const uint8_t *ReadObject(ParseState &state, const std::string &key,
+                                 Object &o, bool &has_checksum, bool root,
+                                 const uint8_t *p, const uint8_t *end) {
+  const uint8_t *begin = p;
+  const uint8_t *object_end;
+  p = ReadContainerHeader(state, key, root, p, end, object_end);
+  if (!p) {
+    return end;
+  }
+  const uint8_t *header_end = p;
+
+  has_checksum = false;
+  bool verify = false;
+  uint32_t stored = 0;
+  if ((object_end - p >= 2 + static_cast<int64_t>(sizeof(uint32_t))) &&
+      (p[0] == CRC32C_TYPE) && (p[1] == '\0')) {
+    has_checksum = true;
+    state.num_uncopyable++;
+    memcpy(&stored, p + 2, sizeof(uint32_t));
+
+    if (state.option.verify_object_checksum) {
+      SkipChecksumRange(state.scopes, p, p + 2 + sizeof(uint32_t));
+
+      ChecksumScope scope;
+      scope.crc = CRC32C(0, begin, static_cast<uint64_t>(header_end - begin));
+      scope.from = p + 2 + sizeof(uint32_t);
+      scope.stored = stored;
+      state.scopes.push_back(scope);
+      verify = true;
+    }
+
+    p += 2 + sizeof(uint32_t);
+  }
+
+  const uint8_t *ptr = p;
+  while (ptr < object_end) {
+    ptr = ParseElement(state, o, ptr, object_end);
+  }
+
+  if (verify) {
+    uint32_t crc = CloseChecksumScope(state.scopes, object_end);
+    if (crc != stored) {
+      state.err << "Checksum mismatch in object `" << key << "`.\n";
+    }
+  }
+
+  return object_end;
+}
+
+static const uint8_t *ReadArray(ParseState &state, const std::string &key,
+                                Array &a, bool root, const uint8_t *p,
+                                const uint8_t *end) {
+  const uint8_t *array_end;
+  p = ReadContainerHeader(state, key, root, p, end, array_end);
+  if (!p) {
+    return end;
+  }
+
+  // Elements are tag + data.
+  const uint8_t *ptr = p;
+  while (ptr < array_end) {
+    Type type = static_cast<Type>(*ptr);
+    ptr++;
+    a.push_back(Value());
+    ptr = ReadValue(state, type, key, a.back(), ptr, array_end);
+  }
+
+  return array_end;
+}
+
+// Read data of an element. Returns `end` on error.
+static const uint8_t *ReadValue(ParseState &state, Type type,
+                                const std::string &key, Value &v,
+                                const uint8_t *ptr, const uint8_t *end) {
+  switch (type) {
+    case FLOAT64_TYPE: {
+      if (!CheckRemaining(state, key, ptr, end, sizeof(double))) return end;
+      double val;
+      ptr = ReadFloat64(val, ptr);
+      v = Value(val);
+    } break;
+    case INT64_TYPE: {
+      int64_t val;
+      if (state.compact) {
+        uint64_t u;
+        ptr = ReadVarint(ptr, end, u);
+        if (!ptr) {
+          state.err << "Invalid varint for `" << key << "`.\n";
+          return end;
+        }
+        val = ZigZagDecode(u);
+      } else {
+        if (!CheckRemaining(state, key, ptr, end, sizeof(int64_t))) return end;
+        ptr = ReadInt64(val, ptr);
+      }
+      v = Value(val);
+    } break;
+    case STRING_TYPE: {
+      // N + string data.
+      int64_t n;
+      ptr = ReadLength(state, key, n, ptr, end);
+      if (!ptr || !CheckRemaining(state, key, ptr, end, n)) return end;
+      v = Value(std::string(reinterpret_cast<const char *>(ptr),
+                            static_cast<size_t>(n)));
+      ptr += n;
+    } break;
+    case BINARY_TYPE: {
+      // N + bin data.
+      int64_t n;
+      ptr = ReadLength(state, key, n, ptr, end);
+      if (!ptr || !CheckRemaining(state, key, ptr, end, n)) return end;
+      // Just save a pointer.
+      v = Value(ptr, static_cast<uint64_t>(n), state.option.buffer);
+      ptr += n;
+    } break;
+    case BINARY_CRC32C_TYPE: {
+      // N + block size + CRC32C per block + bin data.
+      int64_t n, block_size;
+      ptr = ReadLength(state, key, n, ptr, end);
+      if (!ptr) return end;
+      ptr = ReadLength(state, key, block_size, ptr, end);
+      if (!ptr) return end;
+      if ((n < 0) || (block_size <= 0)) {
+        state.err << "Invalid checksummed binary `" << key << "`.\n";
+        return end;
+      }
+      uint64_t un = static_cast<uint64_t>(n);
+      uint64_t bs = static_cast<uint64_t>(block_size);
+      uint64_t num_blocks = un / bs + ((un % bs) ? 1 : 0);
+      // Checked separately so that the sum can't overflow.
+      uint64_t remaining = static_cast<uint64_t>(end - ptr);
+      if ((num_blocks > remaining / sizeof(uint32_t)) ||
+          (un > remaining - num_blocks * sizeof(uint32_t))) {
+        state.err << "Invalid length for `" << key << "`(" << n
+                  << " bytes in blocks of " << block_size << ", "
+                  << remaining << " bytes remaining).\n";
+        return end;
+      }
+      const uint8_t *table = ptr;
+      const uint8_t *data = table + num_blocks * sizeof(uint32_t);
+
+      v = Value(data, static_cast<uint64_t>(n), state.option.buffer);
+      v.EnableChecksum(bs);
+      ParseState::SetChecksumTable(v, table);
+      state.num_uncopyable++;
+
+      if (state.option.verify_binary_checksum &&
+          !v.VerifyChecksum(0, static_cast<uint64_t>(n))) {
+        state.err << "Checksum mismatch in binary `" << key << "`.\n";
+      }
+      SkipChecksumRange(state.scopes, data, data + n);
+
+      ptr = data + n;
+    } break;
+    case BINARY_REF_TYPE: {
+      // offset + N. The payload is that of an earlier binary.
+      const uint8_t *begin = ptr;
+      if (!CheckRemaining(state, key, ptr, end, sizeof(int64_t))) return end;
+      int64_t offset, n;
+      ptr = ReadInt64(offset, ptr);
+      ptr = ReadLength(state, key, n, ptr, end);
+      if (!ptr) return end;
+      int64_t limit = begin - state.document;
+      if ((offset < 0) || (n < 0) || (offset > limit) || (n > limit - offset)) {
+        state.err << "Invalid binary reference for `" << key << "`.\n";
+        return end;
+      }
+      v = Value(state.document + offset, static_cast<uint64_t>(n),
+                state.option.buffer);
+      state.num_uncopyable++;
+    } break;
+    case OBJECT_TYPE: {
+      const uint8_t *begin = ptr;
+      size_t num_uncopyable = state.num_uncopyable;
+
+      Object obj;
+      bool has_checksum = false;
+      ptr = ReadObject(state, key, obj, has_checksum, false, ptr, end);
+
+      v = Value(obj);
+      if (has_checksum) v.EnableChecksum();
+      state.SetSource(v, begin, ptr, num_uncopyable);
+    } break;
+    case ARRAY_TYPE: {
+      const uint8_t *begin = ptr;
+      size_t num_uncopyable = state.num_uncopyable;
+
+      Array arr;
+      ptr = ReadArray(state, key, arr, false, ptr, end);
+
+      v = Value(arr);
+      state.SetSource(v, begin, ptr, num_uncopyable);
+    } break;
+    case COLUMNS_TYPE: {
+      const uint8_t *begin = ptr;
+      const uint8_t *columns_end;
+      ptr = ReadContainerHeader(state, key, false, ptr, end, columns_end);
+      if (!ptr) return end;
+
+      uint64_t rows;
+      std::vector<ColumnField> fields;
+      const char *msg = ReadColumns(ptr, columns_end, rows, fields, true);
+      if (msg) {
+        state.err << msg << " for `" << key << "`.\n";
+        return end;
+      }
+
+      v = Value(Array());
+      state.SetColumns(v, ptr, columns_end);
+      state.SetSource(v, begin, columns_end, state.num_uncopyable);
+      ptr = columns_end;
+    } break;
+    case NULL_TYPE: {
+      v = Value();
+    } break;
+    case BOOL_TYPE: {
+      if (!CheckRemaining(state, key, ptr, end, 1)) return end;
+      v = Value((*ptr) != 0);
+      ptr++;
+    } break;
+    default: {
+      state.err << "Unknown element type " << static_cast<int>(type)
+                << " for `" << key << "`.\n";
+      return end;
+    }
+  }
+
+  return ptr;
+}
+
+static const uint8_t *ParseElement(ParseState &state, Object &o,
+                                   const uint8_t *p, const uint8_t *end) {
+  const uint8_t *ptr = p;
 
   // Read tag;
   Type type = static_cast<Type>(*(reinterpret_cast<const char *>(ptr)));
   ptr++;
 
-  std::string key;
-  ptr = ReadKey(key, ptr);
+  const void *key_end = memchr(ptr, '\0', static_cast<size_t>(end - ptr));
+  if (!key_end) {
+    state.err << "Unterminated key.\n";
+    return end;
+  }
+  std::string key;
+  ptr = ReadKey(key, ptr);
+
+  if (type == CRC32C_TYPE) {
+    // Only valid as the first element of an object.
+    if (!CheckRemaining(state, key, ptr, end, sizeof(uint32_t))) return end;
+    return ptr + sizeof(uint32_t);
+  }
+
+  return ReadValue(state, type, key, o[key], ptr, end);
+}
+
+std::string Parse(Value &v, const uint8_t *p, uint64_t size,
+                  const ParseOption &option) {
+  if (!option.buffer.Empty() && !option.buffer.Contains(p, size)) {
+    return "Data is not in the buffer.\n";
+  }
+
+  ParseState state;
+  state.option = option;
+  state.document = p;
+
+  //
+  // == toplevel element
+  //
+
+  // Read total size.
+  uint64_t header = 0;
+  if (size >= sizeof(int64_t)) {
+    memcpy(&header, p, sizeof(int64_t));
+  }
+  if (header >> 63) {
+    if ((header & ~kHeaderSizeMask) != kCompactHeader) {
+      return "Unsupported encoding version.\n";
+    }
+    state.compact = true;
+  }
+  uint64_t sz = header & kHeaderSizeMask;
+  if ((sz < sizeof(int64_t)) || (sz > size)) {
+    return "Invalid document size.\n";
+  }
+
+  Object obj;
+  bool has_checksum = false;
+  ReadObject(state, "", obj, has_checksum, true, p, p + sz);
+
+  v = Value(obj);
+  if (has_checksum) v.EnableChecksum();
+  if (!state.compact) {
+    // Compact toplevel header can't be reused for a nested object.
+    state.SetSource(v, p, p + sz, 0);
+  }
+
+  return state.err.str();
+}
+
+std::string Parse(Value &v, const uint8_t *p) {
+  uint64_t header = 0;
+  memcpy(&header, p, sizeof(int64_t));
+  return Parse(v, p, header & kHeaderSizeMask, ParseOption());
+}
+
+std::string Parse(Value &v, const Buffer &buffer) {
+  ParseOption option;
+  option.buffer = buffer;
+  return Parse(v, buffer.Data(), buffer.Size(), option);
+}
+
+std::string Parse(Array &v, const uint8_t *p) {
+  ParseState state;
+  state.document = p;
+
+  // Total size of the array.
+  int64_t sz = 0;
+  memcpy(&sz, p, sizeof(int64_t));
+  if (sz < static_cast<int64_t>(sizeof(int64_t))) {
+    return "Invalid array size.\n";
+  }
+
+  ReadArray(state, "", v, true, p, p + sz);
+
+  return state.err.str();
+}
+
+//
+// ESON
+//
+
+struct PrefetchWork {
+  const std::vector<Binary> *ranges;
+  volatile int *cancel;
+  uint64_t page_size;
+};
+
+static void TouchRanges(const PrefetchWork &work) {
+  const std::vector<Binary> &ranges = *work.ranges;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    const volatile uint8_t *p = ranges[i].ptr;
+    uint64_t n = static_cast<uint64_t>(ranges[i].size);
+    uint8_t sink = 0;
+    for (uint64_t offset = 0; offset < n; offset += work.page_size) {
+      if (ESON_ATOMIC_LOAD(work.cancel)) return;
+      sink ^= p[offset];
+    }
+    if (n > 0) sink ^= p[n - 1];
+    (void)sink;
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI PrefetchThreadMain(LPVOID arg) {
+  PrefetchWork *work = reinterpret_cast<PrefetchWork *>(arg);
+  TouchRanges(*work);
+  delete work;
+  return 0;
+}
+#else
+static void *PrefetchThreadMain(void *arg) {
+  PrefetchWork *work = reinterpret_cast<PrefetchWork *>(arg);
+  TouchRanges(*work);
+  delete work;
+  return NULL;
+}
+#endif
+
+// Size of the mapping is passed as `ctx`, since it may be larger than data.
+static void ReleaseMapping(void *ctx, uint8_t *data, uint64_t size) {
+  (void)size;
+#ifdef _WIN32
+  (void)ctx;
+  UnmapViewOfFile(data);
+#else
+  munmap(data, reinterpret_cast<uintptr_t>(ctx));
+#endif
+}
+
+static void ReleaseAnonymous(void *ctx, uint8_t *data, uint64_t size) {
+  (void)size;
+#ifdef _WIN32
+  (void)ctx;
+  VirtualFree(data, 0, MEM_RELEASE);
+#else
+  munmap(data, reinterpret_cast<uintptr_t>(ctx));
+#endif
+}
+
+ESON::ESON()
+    : data_(NULL),
+      size_(0),
+      map_size_(0),
+      page_size_(4096),
+      prefetch_thread_(NULL),
+      prefetch_cancel_(0),
+      valid_(false),
+      anonymous_(false) {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  page_size_ = info.dwAllocationGranularity;
+#else
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (page_size > 0) page_size_ = static_cast<uint64_t>(page_size);
+#endif
+}
+
+ESON::~ESON() { Unload(); }
+
+void ESON::Unload() {
+  CancelPrefetch();
+  prefetch_ranges_.clear();
+
+  // Mapping is released when parsed values also drop their handles.
+  buffer_ = Buffer();
+
+  data_ = NULL;
+  size_ = 0;
+  map_size_ = 0;
+  valid_ = false;
+  anonymous_ = false;
+}
+
+bool ESON::Load(const char *filename) {
+  return Load(filename, LoadOption());
+}
+
+#ifdef _WIN32
+bool ESON::Load(const char *filename, const LoadOption &option) {
+  Unload();
+
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING,
+                            (option.access == ACCESS_SEQUENTIAL)
+                                ? FILE_FLAG_SEQUENTIAL_SCAN
+                                : (option.access == ACCESS_RANDOM)
+                                      ? FILE_FLAG_RANDOM_ACCESS
+                                      : FILE_ATTRIBUTE_NORMAL,
+                            NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart <= 0) {
+    CloseHandle(file);
+    return false;
+  }
+  uint64_t size = static_cast<uint64_t>(file_size.QuadPart);
+
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL) {
+    CloseHandle(file);
+    return false;
+  }
+
+  void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  CloseHandle(file);
+  if (p == NULL) {
+    return false;
+  }
+
+  data_ = reinterpret_cast<uint8_t *>(p);
+  size_ = size;
+  map_size_ = size;
+  buffer_ = Buffer::Wrap(data_, size_, ReleaseMapping, NULL);
+
+  if (option.populate || option.huge_pages) {
+    std::vector<Binary> ranges(1);
+    ranges[0].ptr = data_;
+    ranges[0].size = static_cast<int64_t>(size_);
+    PrefetchWork work;
+    work.ranges = &ranges;
+    work.cancel = &prefetch_cancel_;
+    work.page_size = page_size_;
+    TouchRanges(work);
+  }
+
+  valid_ = true;
+  return true;
+}
+#else
+bool ESON::Load(const char *filename, const LoadOption &option) {
+  Unload();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 || sb.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  uint64_t size = static_cast<uint64_t>(sb.st_size);
+
+  void *p = MAP_FAILED;
+
+#if defined(MADV_HUGEPAGE)
+  if (option.huge_pages) {
+    // Round up to 2MB so that the tail can also be backed by a huge page.
+    const uint64_t huge_page_size = 2 * 1024 * 1024;
+    uint64_t map_size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+    p = mmap(NULL, static_cast<size_t>(map_size), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, static_cast<size_t>(map_size), MADV_HUGEPAGE);
+
+      uint8_t *dst = reinterpret_cast<uint8_t *>(p);
+      uint64_t offset = 0;
+      while (offset < size) {
+        size_t chunk = static_cast<size_t>(std::min(
+            size - offset, static_cast<uint64_t>(64 * 1024 * 1024)));
+        ssize_t n = pread(fd, dst + offset, chunk, static_cast<off_t>(offset));
+        if (n <= 0) break;
+        offset += static_cast<uint64_t>(n);
+      }
+      if (offset != size) {
+        munmap(p, static_cast<size_t>(map_size));
+        close(fd);
+        return false;
+      }
+      mprotect(p, static_cast<size_t>(map_size), PROT_READ);
+      map_size_ = map_size;
+      anonymous_ = true;
+    }
+  }
+#endif
+
+  if (p == MAP_FAILED) {
+    int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+    if (option.populate) flags |= MAP_POPULATE;
+#endif
+    p = mmap(NULL, static_cast<size_t>(size), PROT_READ, flags, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    map_size_ = size;
+  }
+
+  close(fd);
+
+  data_ = reinterpret_cast<uint8_t *>(p);
+  size_ = size;
+  buffer_ = Buffer::Wrap(data_, size_,
+                         anonymous_ ? ReleaseAnonymous : ReleaseMapping,
+                         reinterpret_cast<void *>(
+                             static_cast<uintptr_t>(map_size_)));
+  valid_ = true;
+
+  if (option.access != ACCESS_NORMAL) {
+    Advise(data_, size_, option.access);
+  }
+
+  return true;
+}
+#endif
+
+bool ESON::Dump(const char *filename) {
+  if (!valid_) {
+    return false;
+  }
+
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    return false;
+  }
+
+  size_t n = fwrite(data_, 1, static_cast<size_t>(size_), fp);
+  fclose(fp);
+
+  return (n == static_cast<size_t>(size_));
+}
+
+std::string ESON::Parse(Value &v) const {
+  if (!valid_) {
+    return "No data loaded.";
+  }
+  ParseOption option;
+  option.buffer = buffer_;
+  return ::eson::Parse(v, data_, size_, option);
+}
+
+bool ESON::Advise(const uint8_t *ptr, uint64_t len, Access access) {
+  if (!valid_ || (ptr < data_) || (ptr > data_ + size_) ||
+      (len > size_ - static_cast<uint64_t>(ptr - data_))) {
+    return false;
+  }
+  if (len == 0) {
+    return true;
+  }
+
+#ifdef _WIN32
+  // Only ACCESS_WILLNEED has a counterpart. Other hints are ignored.
+  if (access != ACCESS_WILLNEED) {
+    return true;
+  }
+
+  // PrefetchVirtualMemory() is available since Windows 8. Look it up at run
+  // time so that the program still starts on older systems.
+  struct RangeEntry {
+    PVOID address;
+    SIZE_T size;
+  };
+  typedef BOOL(WINAPI * PrefetchFunc)(HANDLE, ULONG_PTR, RangeEntry *, ULONG);
+  PrefetchFunc prefetch = reinterpret_cast<PrefetchFunc>(GetProcAddress(
+      GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory"));
+  if (!prefetch) {
+    return false;
+  }
+  RangeEntry range;
+  range.address = const_cast<uint8_t *>(ptr);
+  range.size = static_cast<SIZE_T>(len);
+  return prefetch(GetCurrentProcess(), 1, &range, 0) != 0;
+#else
+  int advice;
+  switch (access) {
+    case ACCESS_SEQUENTIAL:
+      advice = MADV_SEQUENTIAL;
+      break;
+    case ACCESS_RANDOM:
+      advice = MADV_RANDOM;
+      break;
+    case ACCESS_WILLNEED:
+      advice = MADV_WILLNEED;
+      break;
+    case ACCESS_DONTNEED:
+      if (anonymous_) return false;  // Would zero the data.
+      advice = MADV_DONTNEED;
+      break;
+    default:
+      advice = MADV_NORMAL;
+      break;
+  }
+
+  // madvise() requires page aligned address.
+  uint64_t offset = static_cast<uint64_t>(ptr - data_);
+  uint64_t begin = offset & ~(page_size_ - 1);
+  uint64_t end = std::min(offset + len, map_size_);
+
+  return madvise(data_ + begin, static_cast<size_t>(end - begin), advice) ==
+         0;
+#endif
+}
+
+bool ESON::Advise(const Binary &bin, Access access) {
+  if (bin.size < 0) {
+    return false;
+  }
+  return Advise(bin.ptr, static_cast<uint64_t>(bin.size), access);
+}
+
+bool ESON::Prefetch(const std::vector<Binary> &ranges) {
+  CancelPrefetch();
+
+  if (!valid_) {
+    return false;
+  }
+
+  prefetch_ranges_.clear();
+  for (size_t i = 0; i < ranges.size(); i++) {
+    const uint8_t *p = ranges[i].ptr;
+    if ((ranges[i].size < 0) || (p < data_) || (p > data_ + size_) ||
+        (static_cast<uint64_t>(ranges[i].size) >
+         size_ - static_cast<uint64_t>(p - data_))) {
+      return false;
+    }
+    prefetch_ranges_.push_back(ranges[i]);
+
+    // Let the kernel start async readahead while the thread touches pages.
+    Advise(ranges[i], ACCESS_WILLNEED);
+  }
+
+  PrefetchWork *work = new PrefetchWork();
+  work->ranges = &prefetch_ranges_;
+  work->cancel = &prefetch_cancel_;
+  work->page_size = page_size_;
+
+#ifdef _WIN32
+  HANDLE thread = CreateThread(NULL, 0, PrefetchThreadMain, work, 0, NULL);
+  if (thread == NULL) {
+    delete work;
+    return false;
+  }
+  prefetch_thread_ = thread;
+#else
+  pthread_t *thread = new pthread_t;
+  if (pthread_create(thread, NULL, PrefetchThreadMain, work) != 0) {
+    delete thread;
+    delete work;
+    return false;
+  }
+  prefetch_thread_ = thread;
+#endif
+
+  return true;
+}
+
+void ESON::WaitPrefetch() {
+  if (!prefetch_thread_) {
+    return;
+  }
+
+#ifdef _WIN32
+  HANDLE thread = reinterpret_cast<HANDLE>(prefetch_thread_);
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_t *thread = reinterpret_cast<pthread_t *>(prefetch_thread_);
+  pthread_join(*thread, NULL);
+  delete thread;
+#endif
+
+  prefetch_thread_ = NULL;
+  ESON_ATOMIC_STORE(&prefetch_cancel_, 0);
+}
+
+void ESON::CancelPrefetch() {
+  if (!prefetch_thread_) {
+    return;
+  }
+  ESON_ATOMIC_STORE(&prefetch_cancel_, 1);
+  WaitPrefetch();
+}
+
+//
+// StreamWriter
+//
+
+static const uint64_t kArrayMark = static_cast<uint64_t>(1) << 63;
+
+static int64_t TellFile(FILE *fp) {
+#ifdef _WIN32
+  return _ftelli64(fp);
+#else
+  return static_cast<int64_t>(ftello(fp));
+#endif
+}
+
+static bool SeekFile(FILE *fp, int64_t offset) {
+#ifdef _WIN32
+  return _fseeki64(fp, offset, SEEK_SET) == 0;
+#else
+  return fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+StreamWriter::StreamWriter(FILE *fp, uint64_t buffer_size)
+    : fp_(fp),
+      out_(NULL),
+      used_(0),
+      flushed_(0),
+      base_(0),
+      max_size_(std::max(buffer_size, static_cast<uint64_t>(4096))) {
+  buf_.resize(static_cast<size_t>(max_size_));
+  int64_t pos = TellFile(fp);
+  if (pos > 0) base_ = pos;
+}
+
+StreamWriter::StreamWriter(std::vector<uint8_t> *out)
+    : fp_(NULL), out_(out), used_(0), flushed_(0), base_(0), max_size_(0) {}
+
+void StreamWriter::Flush() {
+  if (!fp_ || (used_ == 0)) return;
+  if (fwrite(&buf_[0], 1, static_cast<size_t>(used_), fp_) != used_) {
+    if (err_.empty()) err_ = "Failed to write.\n";
+  }
+  flushed_ += used_;
+  used_ = 0;
+}
+
+// Returns `n` contiguous bytes in the buffer.
+uint8_t *StreamWriter::Reserve(uint64_t n) {
+  if (fp_) {
+    if (used_ + n > max_size_) Flush();
+    if (n > buf_.size()) buf_.resize(static_cast<size_t>(n));
+  } else if (used_ + n > buf_.size()) {
+    buf_.resize(static_cast<size_t>(std::max(used_ + n, 2 * used_)));
+  }
+  uint8_t *p = &buf_[static_cast<size_t>(used_)];
+  used_ += n;
+  return p;
+}
+
+void StreamWriter::Write(const uint8_t *p, uint64_t n) {
+  if (n == 0) return;
+  if (fp_ && (n >= max_size_ / 2)) {
+    // Large data bypasses the buffer.
+    Flush();
+    if (fwrite(p, 1, static_cast<size_t>(n), fp_) != n) {
+      if (err_.empty()) err_ = "Failed to write.\n";
+    }
+    flushed_ += n;
+    return;
+  }
+  memcpy(Reserve(n), p, static_cast<size_t>(n));
+}
+
+void StreamWriter::Patch(uint64_t offset, uint64_t value) {
+  if (offset >= flushed_) {
+    memcpy(&buf_[static_cast<size_t>(offset - flushed_)], &value,
+           sizeof(uint64_t));
+    return;
+  }
+
+  // Size field was already written to the file.
+  if (SeekFile(fp_, base_ + static_cast<int64_t>(offset)) &&
+      (fwrite(&value, 1, sizeof(uint64_t), fp_) == sizeof(uint64_t)) &&
+      SeekFile(fp_, base_ + static_cast<int64_t>(flushed_))) {
+    return;
+  }
+  if (err_.empty()) {
+    err_ = "Failed to write back a size. Output must be seekable.\n";
+  }
+}
+
+// Write tag and key, and reserve `n` bytes for data.
+uint8_t *StreamWriter::BeginElement(char tag, const std::string &key,
+                                    uint64_t n) {
+  if (!err_.empty()) return NULL;
+  if (stack_.empty()) {
+    err_ = "Element outside of the toplevel object.\n";
+    return NULL;
+  }
+
+  // Elements of an array have no key.
+  if (stack_.back() & kArrayMark) {
+    uint8_t *p = Reserve(1 + n);
+    (*p) = static_cast<uint8_t>(tag);
+    return p + 1;
+  }
+
+  if (memchr(key.data(), '\0', key.size())) {
+    err_ = "Key contains a null character.\n";
+    return NULL;
+  }
+  uint8_t *p = Reserve(1 + key.size() + 1 + n);
+  (*p++) = static_cast<uint8_t>(tag);
+  memcpy(p, key.data(), key.size());
+  p += key.size();
+  (*p++) = '\0';
+  return p;
+}
+
+void StreamWriter::BeginContainer(char tag, const std::string &key) {
+  if (stack_.empty()) {
+    if (!err_.empty()) return;
+    if ((tag != OBJECT_TYPE) || (Tell() != 0)) {
+      err_ = "Toplevel must be a single object.\n";
+      return;
+    }
+    Reserve(sizeof(int64_t));
+    stack_.push_back(0);
+    return;
+  }
+
+  if (!BeginElement(tag, key, sizeof(int64_t))) return;
+  uint64_t offset = Tell() - sizeof(int64_t);
+  stack_.push_back(offset | ((tag == ARRAY_TYPE) ? kArrayMark : 0));
+}
+
+void StreamWriter::BeginObject(const std::string &key) {
+  BeginContainer(OBJECT_TYPE, key);
+}
+
+void StreamWriter::BeginArray(const std::string &key) {
+  BeginContainer(ARRAY_TYPE, key);
+}
+
+void StreamWriter::End() {
+  if (!err_.empty()) return;
+  if (stack_.empty()) {
+    err_ = "No object or array to close.\n";
+    return;
+  }
+
+  // Total size including the size field.
+  uint64_t offset = stack_.back() & ~kArrayMark;
+  stack_.pop_back();
+  Patch(offset, Tell() - offset);
+}
+
+void StreamWriter::Null(const std::string &key) {
+  BeginElement(NULL_TYPE, key, 0);
+}
+
+void StreamWriter::Bool(const std::string &key, bool b) {
+  uint8_t *p = BeginElement(BOOL_TYPE, key, 1);
+  if (p) (*p) = b ? 1 : 0;
+}
+
+void StreamWriter::Int64(const std::string &key, int64_t i) {
+  uint8_t *p = BeginElement(INT64_TYPE, key, sizeof(int64_t));
+  if (p) memcpy(p, &i, sizeof(int64_t));
+}
+
+void StreamWriter::Float64(const std::string &key, double d) {
+  uint8_t *p = BeginElement(FLOAT64_TYPE, key, sizeof(double));
+  if (p) memcpy(p, &d, sizeof(double));
+}
+
+void StreamWriter::String(const std::string &key, const char *s,
+                          uint64_t n) {
+  uint8_t *p = BeginElement(STRING_TYPE, key, sizeof(int64_t));
+  if (!p) return;
+  memcpy(p, &n, sizeof(int64_t));
+  Write(reinterpret_cast<const uint8_t *>(s), n);
+}
+
+void StreamWriter::Binary(const std::string &key, const uint8_t *data,
+                          uint64_t n) {
+  uint8_t *p = BeginElement(BINARY_TYPE, key, sizeof(int64_t));
+  if (!p) return;
+  memcpy(p, &n, sizeof(int64_t));
+  Write(data, n);
+}
+
+std::string StreamWriter::Finish() {
+  if (err_.empty()) {
+    if (!stack_.empty()) {
+      err_ = "Unclosed object or array.\n";
+    } else if (Tell() == 0) {
+      err_ = "Empty document.\n";
+    }
+  }
+
+  if (fp_) {
+    Flush();
+    fflush(fp_);
+  } else {
+    buf_.resize(static_cast<size_t>(used_));
+    out_->swap(buf_);
+    buf_.clear();
+    used_ = 0;
+  }
+
+  return err_;
+}
+
+//
+// JSON conversion
+//
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define ESON_JSON_SSE2
+#endif
+
+// Buffer size of streamed input and output.
+static const size_t kStreamChunkSize = 1024 * 1024;
+
+// Buffered input from a file or memory.
+struct InputStream {
+  FILE *fp;
+  const uint8_t *start;  // Start of buffered data
+  const uint8_t *p;      // Current position
+  const uint8_t *end;    // End of buffered data
+  uint64_t discarded;    // Bytes before `start`
+  std::vector<uint8_t> buf;
+
+  explicit InputStream(FILE *f)
+      : fp(f), start(NULL), p(NULL), end(NULL), discarded(0) {}
+  InputStream(const uint8_t *data, uint64_t size)
+      : fp(NULL),
+        start(data),
+        p(data),
+        end(data + size),
+        discarded(0) {}
+
+  uint64_t Tell() const {
+    return discarded + static_cast<uint64_t>(p - start);
+  }
+
+  // Make `n` bytes available at `p`. Returns false at the end of input, with
+  // the remaining bytes available.
+  bool Fill(size_t n) {
+    size_t remain = static_cast<size_t>(end - p);
+    if (remain >= n) return true;
+    if (!fp) return false;
+
+    discarded += static_cast<uint64_t>(p - start);
+    size_t capacity = std::max(n, kStreamChunkSize);
+    if (buf.size() < capacity) {
+      std::vector<uint8_t> larger(capacity);
+      if (remain) memcpy(&larger[0], p, remain);
+      buf.swap(larger);
+    } else if (remain) {
+      memmove(&buf[0], p, remain);
+    }
+
+    remain += fread(&buf[remain], 1, buf.size() - remain, fp);
+    start = &buf[0];
+    p = start;
+    end = start + remain;
+    return remain >= n;
+  }
+
+  bool Skip(uint64_t n) {
+    while (n > 0) {
+      if ((p == end) && !Fill(1)) return false;
+      size_t k = static_cast<size_t>(
+          std::min(n, static_cast<uint64_t>(end - p)));
+      p += k;
+      n -= k;
+    }
+    return true;
+  }
+
+  // Move to input position `pos`. File input outside of the buffered data
+  // is seeked, and the buffer is refilled from there.
+  bool Seek(uint64_t pos) {
+    uint64_t buffered_end = discarded + static_cast<uint64_t>(end - start);
+    if ((pos >= discarded) && (pos <= buffered_end)) {
+      p = start + (pos - discarded);
+      return true;
+    }
+    if (!fp) return false;
+    int64_t cur = TellFile(fp);
+    if ((cur < 0) ||
+        !SeekFile(fp, cur + static_cast<int64_t>(pos) -
+                          static_cast<int64_t>(buffered_end))) {
+      return false;
+    }
+    discarded = pos;
+    start = NULL;
+    p = NULL;
+    end = NULL;
+    return true;
+  }
+};
+
+// Buffered output to a file or a string.
+struct OutputStream {
+  FILE *fp;
+  std::string *out;
+  std::vector<char> buf;
+  size_t used;
+  bool failed;
+  char pad7_[7];
 
-  switch (type) {
-    case FLOAT64_TYPE: {
-      double val;
-      ptr = ReadFloat64(val, ptr);
-      o[key] = Value(val);
-    } break;
-    case INT64_TYPE: {
-      int64_t val;
-      ptr = ReadInt64(val, ptr);
-      o[key] = Value(val);
-    } break;
-    case STRING_TYPE: {
-      std::string str;
-      ptr = ReadString(str, ptr);
-      o[key] = Value(str);
-    } break;
-    case BINARY_TYPE: {
-      const uint8_t *bin_ptr;
-      int64_t bin_size;
-      ptr = ReadBinary(bin_ptr, bin_size, ptr);
-      o[key] = Value(bin_ptr, static_cast<uint64_t>(bin_size));
-    } break;
-    case OBJECT_TYPE: {
-      Object obj;
-      ptr = ReadObject(obj, ptr);
+  OutputStream(FILE *f, std::string *s)
+      : fp(f), out(s), buf(kStreamChunkSize), used(0), failed(false) {}
 
-      o[key] = Value(obj);
-    } break;
-    case NULL_TYPE: {
-    } break;
-    case BOOL_TYPE: {
-      // @todo
-      assert(0);
-    } break;
-    case ARRAY_TYPE: {
-      // @todo
-      assert(0);
-    } break;
+  void Flush() {
+    if (used == 0) return;
+    if (fp) {
+      if (fwrite(&buf[0], 1, used, fp) != used) failed = true;
+    } else {
+      out->append(&buf[0], used);
+    }
+    used = 0;
   }
 
-  return ptr;
+  // `n` must be less than the buffer size.
+  char *Reserve(size_t n) {
+    if (used + n > buf.size()) Flush();
+    char *p = &buf[used];
+    used += n;
+    return p;
+  }
+
+  void Put(char c) { (*Reserve(1)) = c; }
+
+  void Append(const char *s, size_t n) {
+    while (n > 0) {
+      if (used == buf.size()) Flush();
+      size_t k = std::min(n, buf.size() - used);
+      memcpy(&buf[used], s, k);
+      used += k;
+      s += k;
+      n -= k;
+    }
+  }
+};
+
+// Find the first '"', '\\' or control character.
+static const uint8_t *FindStringSpecial(const uint8_t *p, const uint8_t *end) {
+#ifdef ESON_JSON_SSE2
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(static_cast<const void *>(p)));
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+        _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));  // v <= 0x1f
+    int mask = _mm_movemask_epi8(m);
+    if (mask) {
+      return p + CountTrailingZeros64(static_cast<uint64_t>(mask));
+    }
+    p += 16;
+  }
+#endif
+  while ((p < end) && ((*p) != '"') && ((*p) != '\\') && ((*p) >= 0x20)) {
+    p++;
+  }
+  return p;
 }
 
-static const uint8_t *ParseElement(std::stringstream &err, Value &v,
-                                   const uint8_t *ptr) {
-  const uint8_t *p = ptr;
-  // Read total size.
-  int64_t val = 0;
-  memcpy(&val, ptr, sizeof(int64_t));
-  int64_t sz = val;
-  ptr += sizeof(int64_t);
-  assert(sz > 0);
+static bool IsJSONWhitespace(uint8_t c) {
+  return (c == ' ') || (c == '\n') || (c == '\r') || (c == '\t');
+}
 
-  Object obj;
+// Skip whitespaces. Returns false at the end of input.
+static bool SkipJSONWhitespace(InputStream &in) {
+  for (;;) {
+    while ((in.p < in.end) && IsJSONWhitespace(*in.p)) in.p++;
+    if (in.p < in.end) return true;
+    if (!in.Fill(1)) return false;
+  }
+}
+
+static int HexDigit(uint8_t c) {
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+  return -1;
+}
 
-  int64_t read_size = 0;
-  while (read_size < sz) {
-    ptr = ParseElement(err, obj, ptr);
-    read_size = ptr - p;
+// Read "\uXXXX". Returns -1 on error.
+static int32_t ReadUnicodeEscape(InputStream &in) {
+  if (!in.Fill(6) || (in.p[0] != '\\') || (in.p[1] != 'u')) return -1;
+  int32_t cp = 0;
+  for (int i = 2; i < 6; i++) {
+    int d = HexDigit(in.p[i]);
+    if (d < 0) return -1;
+    cp = (cp << 4) | d;
   }
-  v = Value(obj);
-  return ptr;
+  in.p += 6;
+  return cp;
 }
 
-static const uint8_t *ParseElement(std::stringstream &err, Array &o,
-                                   const uint8_t *p) {
-  const uint8_t *ptr = p;
+static void AppendUTF8(std::string &s, uint32_t cp) {
+  if (cp < 0x80) {
+    s += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    s += static_cast<char>(0xc0 | (cp >> 6));
+    s += static_cast<char>(0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    s += static_cast<char>(0xe0 | (cp >> 12));
+    s += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+    s += static_cast<char>(0x80 | (cp & 0x3f));
+  } else {
+    s += static_cast<char>(0xf0 | (cp >> 18));
+    s += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+    s += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+    s += static_cast<char>(0x80 | (cp & 0x3f));
+  }
+}
 
-  // Read tag;
-  Type type = static_cast<Type>(*(reinterpret_cast<const char *>(ptr)));
-  ptr++;
+// Read string after the opening quote. Returns error string.
+static const char *ReadJSONString(InputStream &in, std::string &s) {
+  s.clear();
+  for (;;) {
+    const uint8_t *q = FindStringSpecial(in.p, in.end);
+    s.append(reinterpret_cast<const char *>(in.p),
+             static_cast<size_t>(q - in.p));
+    in.p = q;
+    if (q == in.end) {
+      if (!in.Fill(1)) return "Unterminated string";
+      continue;
+    }
+    if ((*q) == '"') {
+      in.p++;
+      return NULL;
+    }
+    if ((*q) < 0x20) return "Control character in string";
+
+    // Escape
+    if (!in.Fill(2)) return "Unterminated string";
+    char c = static_cast<char>(in.p[1]);
+    switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        s += c;
+        break;
+      case 'b':
+        s += '\b';
+        break;
+      case 'f':
+        s += '\f';
+        break;
+      case 'n':
+        s += '\n';
+        break;
+      case 'r':
+        s += '\r';
+        break;
+      case 't':
+        s += '\t';
+        break;
+      case 'u': {
+        int32_t cp = ReadUnicodeEscape(in);
+        if (cp < 0) return "Invalid unicode escape";
+        if ((cp >= 0xd800) && (cp < 0xdc00)) {
+          // Surrogate pair
+          int32_t low = ReadUnicodeEscape(in);
+          if ((low < 0xdc00) || (low >= 0xe000)) {
+            return "Invalid surrogate pair";
+          }
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        } else if ((cp >= 0xdc00) && (cp < 0xe000)) {
+          return "Invalid surrogate pair";
+        }
+        AppendUTF8(s, static_cast<uint32_t>(cp));
+        continue;
+      }
+      default:
+        return "Invalid escape";
+    }
+    in.p += 2;
+  }
+}
+
+// Longest number accepted.
+static const size_t kMaxJSONNumberLength = 1024;
+
+// Read a number. Integers which fit in int64 are returned in `i` with
+// `is_int` set. Returns error string.
+static const char *ReadJSONNumber(InputStream &in, bool &is_int, int64_t &i,
+                                  double &d) {
+  in.Fill(kMaxJSONNumberLength);
+  const uint8_t *p = in.p;
+  const uint8_t *end = in.end;
+
+  bool negative = false;
+  if ((p < end) && ((*p) == '-')) {
+    negative = true;
+    p++;
+  }
+  if ((p == end) || ((*p) < '0') || ((*p) > '9')) return "Invalid number";
+
+  // Up to 19 significant digits are accumulated exactly.
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool exact = true;
+  is_int = true;
+
+  if ((*p) == '0') {
+    p++;
+  } else {
+    for (; (p < end) && ((*p) >= '0') && ((*p) <= '9'); p++) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + static_cast<uint64_t>((*p) - '0');
+        if (mantissa) digits++;
+      } else {
+        exponent++;
+        exact = false;
+      }
+    }
+  }
+  if ((p < end) && ((*p) == '.')) {
+    is_int = false;
+    p++;
+    if ((p == end) || ((*p) < '0') || ((*p) > '9')) return "Invalid number";
+    for (; (p < end) && ((*p) >= '0') && ((*p) <= '9'); p++) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + static_cast<uint64_t>((*p) - '0');
+        if (mantissa) digits++;
+        exponent--;
+      } else {
+        exact = false;
+      }
+    }
+  }
+  if ((p < end) && (((*p) == 'e') || ((*p) == 'E'))) {
+    is_int = false;
+    p++;
+    bool negative_exp = false;
+    if ((p < end) && (((*p) == '+') || ((*p) == '-'))) {
+      negative_exp = ((*p) == '-');
+      p++;
+    }
+    if ((p == end) || ((*p) < '0') || ((*p) > '9')) return "Invalid number";
+    int e = 0;
+    for (; (p < end) && ((*p) >= '0') && ((*p) <= '9'); p++) {
+      if (e < 100000) e = e * 10 + ((*p) - '0');
+    }
+    exponent += negative_exp ? -e : e;
+  }
+  if ((p == end) && (static_cast<size_t>(end - in.p) >= kMaxJSONNumberLength)) {
+    return "Number too long";
+  }
+
+  const uint64_t kInt64Max = (static_cast<uint64_t>(1) << 63) - 1;
+  if (is_int && exact &&
+      (mantissa <= (negative ? kInt64Max + 1 : kInt64Max))) {
+    // Negate in unsigned arithmetic so that INT64_MIN doesn't overflow.
+    uint64_t u = negative ? (~mantissa + 1) : mantissa;
+    memcpy(&i, &u, sizeof(int64_t));
+    in.p = p;
+    return NULL;
+  }
+  is_int = false;
 
+  // Exact if the mantissa and the power of 10 are exact doubles.
+  static const double kPow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                  1e18, 1e19, 1e20, 1e21, 1e22};
+  if (exact && (mantissa <= (static_cast<uint64_t>(1) << 53)) &&
+      (exponent >= -22) && (exponent <= 22)) {
+    d = static_cast<double>(mantissa);
+    d = (exponent < 0) ? d / kPow10[-exponent] : d * kPow10[exponent];
+    if (negative) d = -d;
+  } else {
+    char tmp[kMaxJSONNumberLength + 1];
+    size_t n = static_cast<size_t>(p - in.p);
+    memcpy(tmp, in.p, n);
+    tmp[n] = '\0';
+    d = strtod(tmp, NULL);
+  }
+  in.p = p;
+  return NULL;
+}
+
+static std::string JSONError(const InputStream &in, const char *msg) {
+  std::stringstream ss;
+  ss << msg << " at byte " << in.Tell() << ".\n";
+  return ss.str();
+}
+
+static std::string ConvertJSON(InputStream &in, StreamWriter &writer) {
+  enum {
+    STATE_VALUE,
+    STATE_VALUE_OR_END,  // First element of an array
+    STATE_KEY,
+    STATE_KEY_OR_END,    // First element of an object
+    STATE_COMMA_OR_END
+  } state = STATE_VALUE;
+
+  std::vector<char> stack;  // '{' or '['
   std::string key;
-  if (type != ARRAY_TYPE) ptr = ReadKey(key, ptr);
+  std::string str;
+
+  if (!SkipJSONWhitespace(in) || ((*in.p) != '{')) {
+    return JSONError(in, "Toplevel value must be an object");
+  }
 
-  assert(type == ARRAY_TYPE);
+  for (;;) {
+    if (!SkipJSONWhitespace(in)) {
+      return JSONError(in, "Unexpected end of input");
+    }
+    uint8_t c = *in.p;
 
-  int64_t nElems;
-  ptr = ReadInt64(nElems, ptr);
+    if (state == STATE_KEY_OR_END && (c == '}')) {
+      state = STATE_COMMA_OR_END;
+    } else if (state == STATE_VALUE_OR_END && (c == ']')) {
+      state = STATE_COMMA_OR_END;
+    } else if ((state == STATE_KEY) || (state == STATE_KEY_OR_END)) {
+      if (c != '"') return JSONError(in, "Expected a key");
+      in.p++;
+      const char *err = ReadJSONString(in, key);
+      if (err) return JSONError(in, err);
+      if (!SkipJSONWhitespace(in) || ((*in.p) != ':')) {
+        return JSONError(in, "Expected ':'");
+      }
+      in.p++;
+      state = STATE_VALUE;
+      continue;
+    } else if (state != STATE_COMMA_OR_END) {
+      // Value
+      if (c == '{') {
+        writer.BeginObject(key);
+        stack.push_back('{');
+        in.p++;
+        state = STATE_KEY_OR_END;
+        continue;
+      } else if (c == '[') {
+        writer.BeginArray(key);
+        stack.push_back('[');
+        in.p++;
+        state = STATE_VALUE_OR_END;
+        continue;
+      } else if (c == '"') {
+        in.p++;
+        const char *err = ReadJSONString(in, str);
+        if (err) return JSONError(in, err);
+        writer.String(key, str.data(), str.size());
+      } else if ((c == '-') || ((c >= '0') && (c <= '9'))) {
+        bool is_int;
+        int64_t i = 0;
+        double d = 0.0;
+        const char *err = ReadJSONNumber(in, is_int, i, d);
+        if (err) return JSONError(in, err);
+        if (is_int) {
+          writer.Int64(key, i);
+        } else {
+          writer.Float64(key, d);
+        }
+      } else if ((c == 't') && in.Fill(4) && !memcmp(in.p, "true", 4)) {
+        writer.Bool(key, true);
+        in.p += 4;
+      } else if ((c == 'f') && in.Fill(5) && !memcmp(in.p, "false", 5)) {
+        writer.Bool(key, false);
+        in.p += 5;
+      } else if ((c == 'n') && in.Fill(4) && !memcmp(in.p, "null", 4)) {
+        writer.Null(key);
+        in.p += 4;
+      } else {
+        return JSONError(in, "Unexpected character");
+      }
+      state = STATE_COMMA_OR_END;
+      continue;
+    }
 
-  for (size_t i = 0; i < static_cast<size_t>(nElems); i++) {
-    Value value;
-    ptr = ParseElement(err, value, ptr);
-    o.push_back(value);
+    // After a value
+    if (c == ',') {
+      in.p++;
+      state = (stack.back() == '{') ? STATE_KEY : STATE_VALUE;
+      continue;
+    }
+    if (!(((c == '}') && (stack.back() == '{')) ||
+          ((c == ']') && (stack.back() == '[')))) {
+      return JSONError(in, "Expected ',' or the end of object or array");
+    }
+    in.p++;
+    writer.End();
+    stack.pop_back();
+    if (stack.empty()) break;
   }
 
-  return ptr;
+  if (SkipJSONWhitespace(in)) {
+    return JSONError(in, "Extra data after the toplevel object");
+  }
+  return "";
 }
 
-std::string Parse(Value &v, const uint8_t *p) {
-  std::stringstream err;
+std::string JSONToESON(FILE *in, FILE *out) {
+  InputStream input(in);
+  StreamWriter writer(out);
+  std::string err = ConvertJSON(input, writer);
+  std::string write_err = writer.Finish();
+  return err.empty() ? write_err : err;
+}
 
-  const uint8_t *ptr = p;
+std::string JSONToESON(const char *json, size_t len,
+                       std::vector<uint8_t> &out) {
+  InputStream input(reinterpret_cast<const uint8_t *>(json), len);
+  StreamWriter writer(&out);
+  std::string err = ConvertJSON(input, writer);
+  std::string write_err = writer.Finish();
+  return err.empty() ? write_err : err;
+}
 
-  //
-  // == toplevel element
-  //
+static void WriteJSONString(OutputStream &out, const uint8_t *p,
+                            const uint8_t *end) {
+  static const char kHex[] = "0123456789abcdef";
+  while (p < end) {
+    const uint8_t *q = FindStringSpecial(p, end);
+    out.Append(reinterpret_cast<const char *>(p), static_cast<size_t>(q - p));
+    if (q == end) break;
+    char *e = out.Reserve(2);
+    e[0] = '\\';
+    switch (*q) {
+      case '"':
+        e[1] = '"';
+        break;
+      case '\\':
+        e[1] = '\\';
+        break;
+      case '\n':
+        e[1] = 'n';
+        break;
+      case '\r':
+        e[1] = 'r';
+        break;
+      case '\t':
+        e[1] = 't';
+        break;
+      default:
+        e[1] = 'u';
+        e = out.Reserve(4);
+        e[0] = '0';
+        e[1] = '0';
+        e[2] = kHex[(*q) >> 4];
+        e[3] = kHex[(*q) & 0xf];
+        break;
+    }
+    p = q + 1;
+  }
+}
 
-  // Read total size.
-  int64_t val = 0;
-  memcpy(&val, ptr, sizeof(int64_t));
-  int64_t sz = val;
-  ptr += sizeof(int64_t);
-  assert(sz > 0);
+static void WriteJSONInt64(OutputStream &out, int64_t i) {
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  uint64_t u;
+  memcpy(&u, &i, sizeof(int64_t));
+  if (i < 0) u = ~u + 1;
+  do {
+    (*--p) = static_cast<char>('0' + (u % 10));
+    u /= 10;
+  } while (u);
+  if (i < 0) (*--p) = '-';
+  out.Append(p, static_cast<size_t>(tmp + sizeof(tmp) - p));
+}
 
-  Object obj;
+// Shortest decimal digits of doubles which read back to the same value.
+// Grisu2 of F. Loitsch, "Printing Floating-Point Numbers Quickly and
+// Accurately with Integers", PLDI 2010.
+struct DiyFp {
+  uint64_t f;
+  int e;
+  char pad4_[4];
+};
 
-  int64_t read_size = 0;
-  while (read_size < sz) {
-    ptr = ParseElement(err, obj, ptr);
-    read_size = ptr - p;
+static DiyFp MakeDiyFp(uint64_t f, int e) {
+  DiyFp x;
+  x.f = f;
+  x.e = e;
+  return x;
+}
+
+// Upper 64 bits of the product, rounded.
+static DiyFp MultiplyDiyFp(const DiyFp &x, const DiyFp &y) {
+  const uint64_t kMask32 = 0xffffffff;
+  uint64_t a = x.f >> 32, b = x.f & kMask32;
+  uint64_t c = y.f >> 32, d = y.f & kMask32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & kMask32) + (bc & kMask32);
+  tmp += static_cast<uint64_t>(1) << 31;
+  return MakeDiyFp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64);
+}
+
+static DiyFp NormalizeDiyFp(DiyFp x) {
+  const uint64_t kTopBit = static_cast<uint64_t>(1) << 63;
+  while (!(x.f & kTopBit)) {
+    x.f <<= 1;
+    x.e--;
   }
+  return x;
+}
 
-  v = Value(obj);
+// 10^k for k = -348, -340, ..., 340 as normalized DiyFp.
+static const uint64_t kCachedPowerF[] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76),
+    UINT64_C(0x8b16fb203055ac76), UINT64_C(0xcf42894a5dce35ea),
+    UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f),
+    UINT64_C(0xbe5691ef416bd60c), UINT64_C(0x8dd01fad907ffc3c),
+    UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d),
+    UINT64_C(0x823c12795db6ce57), UINT64_C(0xc21094364dfb5637),
+    UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5),
+    UINT64_C(0xb23867fb2a35b28e), UINT64_C(0x84c8d4dfd2c63f3b),
+    UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6),
+    UINT64_C(0xf3e2f893dec3f126), UINT64_C(0xb5b5ada8aaff80b8),
+    UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd),
+    UINT64_C(0xa6dfbd9fb8e5b88f), UINT64_C(0xf8a95fcf88747d94),
+    UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac),
+    UINT64_C(0xe45c10c42a2b3b06), UINT64_C(0xaa242499697392d3),
+    UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c),
+    UINT64_C(0x9c40000000000000), UINT64_C(0xe8d4a51000000000),
+    UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70),
+    UINT64_C(0xd5d238a4abe98068), UINT64_C(0x9f4f2726179a2245),
+    UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a),
+    UINT64_C(0x924d692ca61be758), UINT64_C(0xda01ee641a708dea),
+    UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2),
+    UINT64_C(0xc83553c5c8965d3d), UINT64_C(0x952ab45cfa97a0b3),
+    UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece),
+    UINT64_C(0x88fcf317f22241e2), UINT64_C(0xcc20ce9bd35c78a5),
+    UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c),
+    UINT64_C(0xbb764c4ca7a44410), UINT64_C(0x8bab8eefb6409c1a),
+    UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429),
+    UINT64_C(0x80444b5e7aa7cf85), UINT64_C(0xbf21e44003acdd2d),
+    UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9),
+    UINT64_C(0xaf87023b9bf0ee6b),
+};
+static const int16_t kCachedPowerE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
 
-  return err.str();
+// Cached power c = 10^-K such that the product with a DiyFp of exponent `e`
+// has an exponent in [-60, -32].
+static DiyFp GetCachedPower(int e, int &K) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347;  // log10(2)
+  int k = static_cast<int>(dk);
+  if (dk - k > 0.0) k++;
+  size_t index = static_cast<size_t>((k >> 3) + 1);
+  K = -(-348 + static_cast<int>(index << 3));
+  return MakeDiyFp(kCachedPowerF[index], kCachedPowerE[index]);
 }
 
-std::string Parse(Array &v, const uint8_t *p) {
-  std::stringstream err;
+static void GrisuRound(char *buffer, int len, uint64_t delta, uint64_t rest,
+                       uint64_t ten_kappa, uint64_t wp_w) {
+  while ((rest < wp_w) && (delta - rest >= ten_kappa) &&
+         ((rest + ten_kappa < wp_w) ||
+          (wp_w - rest > rest + ten_kappa - wp_w))) {
+    buffer[len - 1]--;
+    rest += ten_kappa;
+  }
+}
 
-  const uint8_t *ptr = p;
+static void GrisuDigits(const DiyFp &W, const DiyFp &Mp, uint64_t delta,
+                        char *buffer, int &len, int &K) {
+  static const uint32_t kPow10[] = {1,      10,      100,      1000,
+                                    10000,  100000,  1000000,  10000000,
+                                    100000000, 1000000000};
+  const int shift = -Mp.e;
+  const uint64_t one = static_cast<uint64_t>(1) << shift;
+  const uint64_t wp_w = Mp.f - W.f;
+  uint32_t p1 = static_cast<uint32_t>(Mp.f >> shift);
+  uint64_t p2 = Mp.f & (one - 1);
 
-  //
-  // == toplevel element
-  //
+  int kappa = 1;
+  while ((kappa < 10) && (p1 >= kPow10[kappa])) kappa++;
 
-  // Read total size.
-  int64_t val = 0;
-  memcpy(&val, ptr, sizeof(int64_t));
-  int64_t sz = val;
-  ptr += sizeof(int64_t);
-  assert(sz > 0);
+  len = 0;
+  while (kappa > 0) {
+    uint32_t d = p1 / kPow10[kappa - 1];
+    p1 %= kPow10[kappa - 1];
+    if (d || len) buffer[len++] = static_cast<char>('0' + d);
+    kappa--;
+    uint64_t rest = (static_cast<uint64_t>(p1) << shift) + p2;
+    if (rest <= delta) {
+      K += kappa;
+      GrisuRound(buffer, len, delta, rest,
+                 static_cast<uint64_t>(kPow10[kappa]) << shift, wp_w);
+      return;
+    }
+  }
+
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    char d = static_cast<char>(p2 >> shift);
+    if (d || len) buffer[len++] = static_cast<char>('0' + d);
+    p2 &= one - 1;
+    kappa--;
+    if (p2 < delta) {
+      K += kappa;
+      int index = -kappa;
+      GrisuRound(buffer, len, delta, p2, one,
+                 wp_w * ((index < 10) ? kPow10[index] : 0));
+      return;
+    }
+  }
+}
+
+// Digits of positive finite `d`. The value is digits * 10^K.
+static void Grisu2(double d, char *buffer, int &len, int &K) {
+  const uint64_t kHiddenBit = static_cast<uint64_t>(1) << 52;
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(double));
+  int biased_e = static_cast<int>((bits >> 52) & 0x7ff);
+  uint64_t significand = bits & (kHiddenBit - 1);
+
+  DiyFp v = (biased_e != 0) ? MakeDiyFp(significand + kHiddenBit,
+                                        biased_e - 1075)
+                            : MakeDiyFp(significand, -1074);
+
+  // Boundaries between `v` and its neighbors.
+  DiyFp plus = NormalizeDiyFp(MakeDiyFp((v.f << 1) + 1, v.e - 1));
+  DiyFp minus = (v.f == kHiddenBit) ? MakeDiyFp((v.f << 2) - 1, v.e - 2)
+                                    : MakeDiyFp((v.f << 1) - 1, v.e - 1);
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  DiyFp c = GetCachedPower(plus.e, K);
+  DiyFp W = MultiplyDiyFp(NormalizeDiyFp(v), c);
+  DiyFp Wp = MultiplyDiyFp(plus, c);
+  DiyFp Wm = MultiplyDiyFp(minus, c);
+  Wm.f++;
+  Wp.f--;
+  GrisuDigits(W, Wp, Wp.f - Wm.f, buffer, len, K);
+}
+
+static void WriteJSONFloat64(OutputStream &out, double d) {
+  if ((d != d) || (d - d != 0.0)) {
+    out.Append("null", 4);  // JSON has no NaN or infinity.
+    return;
+  }
+
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(double));
+
+  char *p = out.Reserve(32);
+  char *begin = p;
+  if (bits >> 63) {
+    (*p++) = '-';
+    d = -d;
+  }
+  if (d == 0.0) {
+    memcpy(p, "0.0", 3);
+    out.used -= static_cast<size_t>(32 - (p + 3 - begin));
+    return;
+  }
+
+  char digits[24];
+  int len, K;
+  Grisu2(d, digits, len, K);
+
+  // Same notation as Python's repr(). Always has '.' or 'e' so that it is
+  // read back as a float.
+  int exp10 = len + K - 1;  // 10^exp10 <= d < 10^(exp10 + 1)
+  if ((exp10 >= -4) && (exp10 < 16)) {
+    if (K >= 0) {
+      memcpy(p, digits, static_cast<size_t>(len));
+      p += len;
+      memset(p, '0', static_cast<size_t>(K));
+      p += K;
+      memcpy(p, ".0", 2);
+      p += 2;
+    } else if (exp10 >= 0) {
+      memcpy(p, digits, static_cast<size_t>(exp10 + 1));
+      p += exp10 + 1;
+      (*p++) = '.';
+      memcpy(p, digits + exp10 + 1, static_cast<size_t>(len - exp10 - 1));
+      p += len - exp10 - 1;
+    } else {
+      memcpy(p, "0.", 2);
+      p += 2;
+      memset(p, '0', static_cast<size_t>(-exp10 - 1));
+      p += -exp10 - 1;
+      memcpy(p, digits, static_cast<size_t>(len));
+      p += len;
+    }
+  } else {
+    (*p++) = digits[0];
+    if (len > 1) {
+      (*p++) = '.';
+      memcpy(p, digits + 1, static_cast<size_t>(len - 1));
+      p += len - 1;
+    }
+    (*p++) = 'e';
+    (*p++) = (exp10 < 0) ? '-' : '+';
+    int e = (exp10 < 0) ? -exp10 : exp10;
+    if (e >= 100) (*p++) = static_cast<char>('0' + e / 100);
+    (*p++) = static_cast<char>('0' + (e / 10) % 10);
+    (*p++) = static_cast<char>('0' + e % 10);
+  }
+  out.used -= static_cast<size_t>(32 - (p - begin));
+}
+
+static void WriteBase64(OutputStream &out, const uint8_t *p, size_t n) {
+  static const char kBase64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  for (; n >= 3; n -= 3, p += 3) {
+    uint32_t v = (static_cast<uint32_t>(p[0]) << 16) |
+                 (static_cast<uint32_t>(p[1]) << 8) | p[2];
+    char *e = out.Reserve(4);
+    e[0] = kBase64[(v >> 18) & 0x3f];
+    e[1] = kBase64[(v >> 12) & 0x3f];
+    e[2] = kBase64[(v >> 6) & 0x3f];
+    e[3] = kBase64[v & 0x3f];
+  }
+  if (n > 0) {
+    uint32_t v = static_cast<uint32_t>(p[0]) << 16;
+    if (n > 1) v |= static_cast<uint32_t>(p[1]) << 8;
+    char *e = out.Reserve(4);
+    e[0] = kBase64[(v >> 18) & 0x3f];
+    e[1] = kBase64[(v >> 12) & 0x3f];
+    e[2] = (n > 1) ? kBase64[(v >> 6) & 0x3f] : '=';
+    e[3] = '=';
+  }
+}
+
+// Read a length of string, binary, object or array.
+static bool ReadStreamLength(InputStream &in, bool compact, uint64_t &n) {
+  if (compact) {
+    in.Fill(10);
+    const uint8_t *p = ReadVarint(in.p, in.end, n);
+    if (!p) return false;
+    in.p = p;
+    return true;
+  }
+  if (!in.Fill(sizeof(int64_t))) return false;
+  memcpy(&n, in.p, sizeof(int64_t));
+  in.p += sizeof(int64_t);
+  return true;
+}
+
+struct OpenContainer {
+  uint64_t end;  // Position of the end of the container
+  bool array;
+  bool first;  // No element has been written yet.
+  char pad6_[6];
+};
+
+// Read a null terminated key. Returns false if the input ends first.
+static bool ReadStreamKey(InputStream &in, std::string &key) {
+  key.clear();
+  for (;;) {
+    const void *q = memchr(in.p, '\0', static_cast<size_t>(in.end - in.p));
+    if (q) {
+      const uint8_t *key_end = static_cast<const uint8_t *>(q);
+      key.append(reinterpret_cast<const char *>(in.p),
+                 static_cast<size_t>(key_end - in.p));
+      in.p = key_end + 1;
+      return true;
+    }
+    key.append(reinterpret_cast<const char *>(in.p),
+               static_cast<size_t>(in.end - in.p));
+    in.p = in.end;
+    if (!in.Fill(1)) return false;
+  }
+}
+
+// Read `n` bytes at input position `pos` without moving the current
+// position. Returns a pointer to them, into the input buffer or `scratch`,
+// or NULL if they can't be read. File input is read with a seek and
+// restored.
+static const uint8_t *ReadAt(InputStream &in, uint64_t pos, uint64_t n,
+                             std::vector<uint8_t> &scratch) {
+  static const uint8_t kEmpty = 0;
+  if (n == 0) return &kEmpty;
+
+  uint64_t buffered_end =
+      in.discarded + static_cast<uint64_t>(in.end - in.start);
+  if ((pos >= in.discarded) && (pos <= buffered_end) &&
+      (n <= buffered_end - pos)) {
+    return in.start + (pos - in.discarded);
+  }
+  if (!in.fp) return NULL;
+
+  int64_t cur = TellFile(in.fp);
+  if ((cur < 0) ||
+      !SeekFile(in.fp, cur + static_cast<int64_t>(pos) -
+                           static_cast<int64_t>(buffered_end))) {
+    return NULL;
+  }
+  scratch.resize(static_cast<size_t>(n));
+  bool ok = (fread(&scratch[0], 1, scratch.size(), in.fp) == scratch.size());
+  if (!SeekFile(in.fp, cur) || !ok) return NULL;
+  return &scratch[0];
+}
+
+// Columnar arrays are converted in batches of rows taking at most this many
+// bytes of column data, so that memory stays bounded for large arrays.
+static const uint64_t kColumnsBatchSize = 16 * kStreamChunkSize;
+
+struct StreamColumn {
+  std::string key;
+  uint64_t pos;                  // Input position of the column
+  uint64_t size;                 // Bytes of the column
+  std::vector<uint8_t> offsets;  // String and binary: offsets of the batch
+  std::vector<uint8_t> scratch;  // Data of the batch read from a file
+  Column window;                 // Rows of the batch
+};
+
+// Read offsets [r0, r1] of a string or binary column into `c.offsets`.
+// Returns false if they are broken.
+static bool ReadColumnOffsets(InputStream &in, StreamColumn &c, uint64_t rows,
+                              uint64_t r0, uint64_t r1) {
+  size_t n = static_cast<size_t>((r1 - r0 + 1) * sizeof(int64_t));
+  const uint8_t *q =
+      ReadAt(in, c.pos + r0 * sizeof(int64_t), n, c.scratch);
+  if (!q) return false;
+  c.offsets.assign(q, q + n);
+
+  uint64_t data_size = c.size - (rows + 1) * sizeof(int64_t);
+  uint64_t prev = 0;
+  for (uint64_t i = 0; i <= r1 - r0; i++) {
+    uint64_t offset;
+    memcpy(&offset, &c.offsets[static_cast<size_t>(i * sizeof(int64_t))],
+           sizeof(int64_t));
+    if (((i == 0) && (r0 == 0) && (offset != 0)) ||
+        ((i > 0) && (offset < prev)) || (offset > data_size)) {
+      return false;
+    }
+    prev = offset;
+  }
+  return (r1 < rows) || (prev == data_size);
+}
+
+// Write columnar content from the current position to `content_end` as an
+// array of objects, and move to `content_end`.
+// Returns an error message, or NULL if success.
+static const char *WriteJSONColumns(InputStream &in, OutputStream &out,
+                                    uint64_t content_end) {
+  if ((content_end - in.Tell() < 2 * sizeof(int64_t)) ||
+      !in.Fill(2 * sizeof(int64_t))) {
+    return "Truncated columnar array";
+  }
+  int64_t num_rows, num_fields;
+  memcpy(&num_rows, in.p, sizeof(int64_t));
+  memcpy(&num_fields, in.p + sizeof(int64_t), sizeof(int64_t));
+  in.p += 2 * sizeof(int64_t);
+  // A field takes 10 bytes at least. There is one field at least.
+  if ((num_rows <= 0) || (static_cast<uint64_t>(num_rows) > kHeaderSizeMask) ||
+      (num_fields <= 0) ||
+      (static_cast<uint64_t>(num_fields) > content_end - in.Tell())) {
+    return "Invalid size of columnar array";
+  }
+  uint64_t rows = static_cast<uint64_t>(num_rows);
+
+  // Schema.
+  std::vector<StreamColumn> columns(static_cast<size_t>(num_fields));
+  uint64_t row_size = 0;  // Bytes per row except string and binary data
+  for (size_t f = 0; f < columns.size(); f++) {
+    StreamColumn &c = columns[f];
+    if ((in.Tell() >= content_end) || !in.Fill(1)) {
+      return "Truncated columnar array";
+    }
+    c.window.type = static_cast<char>(*in.p++);
+    if (!IsColumnType(c.window.type)) return "Invalid column type";
+    if (!ReadStreamKey(in, c.key)) return "Unterminated key";
+    // Same order as the keys of an object.
+    if ((f > 0) && (columns[f - 1].key >= c.key)) {
+      return "Column keys are not sorted";
+    }
+    if (!in.Fill(sizeof(int64_t))) return "Truncated columnar array";
+    memcpy(&c.size, in.p, sizeof(int64_t));
+    in.p += sizeof(int64_t);
+
+    uint64_t stride = ColumnStride(c.window.type);
+    if (stride ? (c.size != rows * stride)
+               : (c.size < (rows + 1) * sizeof(int64_t))) {
+      return "Invalid column size";
+    }
+    row_size += stride ? stride : sizeof(int64_t);
+  }
+
+  uint64_t pos = in.Tell();
+  if (pos > content_end) return "Truncated columnar array";
+  for (size_t f = 0; f < columns.size(); f++) {
+    if (columns[f].size > content_end - pos) {
+      return "Truncated columnar array";
+    }
+    columns[f].pos = pos;
+    pos += columns[f].size;
+  }
+  if (pos != content_end) return "Invalid size of columnar array";
+
+  out.Put('[');
+  for (uint64_t r0 = 0; r0 < rows;) {
+    // Rows [r0, r1). Halve the batch until string and binary data fit.
+    uint64_t r1 = r0 + std::max(UINT64_C(1),
+                                std::min(rows - r0, kColumnsBatchSize /
+                                                        std::max(row_size,
+                                                                 UINT64_C(1))));
+    for (;;) {
+      uint64_t bytes = (r1 - r0) * row_size;
+      for (size_t f = 0; f < columns.size(); f++) {
+        StreamColumn &c = columns[f];
+        if (ColumnStride(c.window.type)) continue;
+        if (!ReadColumnOffsets(in, c, rows, r0, r1)) {
+          return "Invalid column offsets";
+        }
+        uint64_t first, last;
+        memcpy(&first, &c.offsets[0], sizeof(int64_t));
+        memcpy(&last, &c.offsets[c.offsets.size() - sizeof(int64_t)],
+               sizeof(int64_t));
+        bytes += last - first;
+      }
+      if (bytes <= kColumnsBatchSize) break;
+      if (r1 - r0 == 1) return "Row of columnar array is too large";
+      r1 = r0 + (r1 - r0) / 2;
+    }
+
+    // Read the batch of each column.
+    for (size_t f = 0; f < columns.size(); f++) {
+      StreamColumn &c = columns[f];
+      uint64_t stride = ColumnStride(c.window.type);
+      const uint8_t *q;
+      if (stride) {
+        q = ReadAt(in, c.pos + r0 * stride, (r1 - r0) * stride, c.scratch);
+      } else {
+        // Rebase offsets to the batch.
+        uint64_t first, last = 0;
+        memcpy(&first, &c.offsets[0], sizeof(int64_t));
+        for (size_t i = 0; i < c.offsets.size(); i += sizeof(int64_t)) {
+          memcpy(&last, &c.offsets[i], sizeof(int64_t));
+          last -= first;
+          memcpy(&c.offsets[i], &last, sizeof(int64_t));
+        }
+        q = ReadAt(in, c.pos + (rows + 1) * sizeof(int64_t) + first, last,
+                   c.scratch);
+        c.window.offsets = &c.offsets[0];
+      }
+      if (!q) return "Failed to read columnar array";
+      c.window.data = q;
+      c.window.rows = r1 - r0;
+    }
+
+    for (uint64_t r = r0; r < r1; r++) {
+      if (r > 0) out.Put(',');
+      out.Put('{');
+      for (size_t f = 0; f < columns.size(); f++) {
+        const StreamColumn &c = columns[f];
+        const Column &column = c.window;
+        uint64_t i = r - r0;
+        if (f > 0) out.Put(',');
+        out.Put('"');
+        const uint8_t *k = reinterpret_cast<const uint8_t *>(c.key.data());
+        WriteJSONString(out, k, k + c.key.size());
+        out.Append("\":", 2);
+
+        uint64_t n;
+        switch (column.type) {
+          case BOOL_TYPE:
+            if (column.Bool(i)) {
+              out.Append("true", 4);
+            } else {
+              out.Append("false", 5);
+            }
+            break;
+          case INT64_TYPE:
+            WriteJSONInt64(out, column.Int64(i));
+            break;
+          case FLOAT64_TYPE:
+            WriteJSONFloat64(out, column.Float64(i));
+            break;
+          case STRING_TYPE: {
+            const uint8_t *str = column.Bytes(i, n);
+            out.Put('"');
+            WriteJSONString(out, str, str + n);
+            out.Put('"');
+          } break;
+          case BINARY_TYPE: {
+            const uint8_t *b = column.Bytes(i, n);
+            out.Put('"');
+            WriteBase64(out, b, static_cast<size_t>(n));
+            out.Put('"');
+          } break;
+          default:
+            assert(0);
+            break;
+        }
+      }
+      out.Put('}');
+    }
+    if (out.failed) return NULL;  // Reported by the caller.
+    r0 = r1;
+  }
+  out.Put(']');
+
+  if (!in.Seek(content_end)) return "Failed to read columnar array";
+  return NULL;
+}
 
-  int64_t read_size = 0;
-  while (read_size < sz) {
-    ptr = ParseElement(err, v, ptr);
-    read_size = ptr - p;
+static std::string ESONError(const InputStream &in, const char *msg) {
+  std::stringstream ss;
+  ss << msg << " at byte " << in.Tell() << ".\n";
+  return ss.str();
+}
+
+// Write `n` bytes at input position `pos` as base64.
+// Returns false if the bytes can't be read.
+static bool WriteBase64At(InputStream &in, uint64_t pos, uint64_t n,
+                          OutputStream &out) {
+  std::vector<uint8_t> scratch;
+  // Base64 encodes 3 bytes at once.
+  const uint64_t chunk = kStreamChunkSize - kStreamChunkSize % 3;
+  while (n > 0) {
+    uint64_t k = std::min(n, chunk);
+    const uint8_t *q = ReadAt(in, pos, k, scratch);
+    if (!q) return false;
+    WriteBase64(out, q, static_cast<size_t>(k));
+    pos += k;
+    n -= k;
+  }
+  return true;
+}
+
+static std::string ConvertESON(InputStream &in, OutputStream &out) {
+  uint64_t header;
+  if (!in.Fill(sizeof(int64_t))) return "Invalid document size.\n";
+  memcpy(&header, in.p, sizeof(int64_t));
+  bool compact = false;
+  if (header >> 63) {
+    if ((header & ~kHeaderSizeMask) != kCompactHeader) {
+      return "Unsupported encoding version.\n";
+    }
+    compact = true;
+  }
+  uint64_t begin = in.Tell();
+  in.p += sizeof(int64_t);
+
+  std::vector<OpenContainer> stack;
+  OpenContainer root;
+  root.end = begin + (header & kHeaderSizeMask);
+  root.array = false;
+  root.first = true;
+  stack.push_back(root);
+  out.Put('{');
+
+  std::string key;
+  while (!stack.empty()) {
+    OpenContainer &top = stack.back();
+    uint64_t pos = in.Tell();
+    if (pos >= top.end) {
+      if (pos > top.end) return ESONError(in, "Element overruns its parent");
+      out.Put(top.array ? ']' : '}');
+      stack.pop_back();
+      continue;
+    }
+
+    if (!in.Fill(1)) return ESONError(in, "Unexpected end of data");
+    uint8_t tag = *in.p++;
+
+    if (!top.array && !ReadStreamKey(in, key)) {
+      return ESONError(in, "Unterminated key");
+    }
+
+    if (tag == CRC32C_TYPE) {
+      if (!in.Skip(sizeof(uint32_t))) {
+        return ESONError(in, "Unexpected end of data");
+      }
+      continue;
+    }
+
+    if (!top.first) out.Put(',');
+    top.first = false;
+    if (!top.array) {
+      out.Put('"');
+      const uint8_t *k = reinterpret_cast<const uint8_t *>(key.data());
+      WriteJSONString(out, k, k + key.size());
+      out.Append("\":", 2);
+    }
+
+    switch (tag) {
+      case NULL_TYPE:
+        out.Append("null", 4);
+        break;
+      case BOOL_TYPE:
+        if (!in.Fill(1)) return ESONError(in, "Unexpected end of data");
+        if (*in.p++) {
+          out.Append("true", 4);
+        } else {
+          out.Append("false", 5);
+        }
+        break;
+      case FLOAT64_TYPE: {
+        if (!in.Fill(sizeof(double))) {
+          return ESONError(in, "Unexpected end of data");
+        }
+        double d;
+        memcpy(&d, in.p, sizeof(double));
+        in.p += sizeof(double);
+        WriteJSONFloat64(out, d);
+      } break;
+      case INT64_TYPE: {
+        int64_t i;
+        if (compact) {
+          uint64_t u;
+          if (!ReadStreamLength(in, true, u)) {
+            return ESONError(in, "Invalid varint");
+          }
+          i = ZigZagDecode(u);
+        } else {
+          if (!in.Fill(sizeof(int64_t))) {
+            return ESONError(in, "Unexpected end of data");
+          }
+          memcpy(&i, in.p, sizeof(int64_t));
+          in.p += sizeof(int64_t);
+        }
+        WriteJSONInt64(out, i);
+      } break;
+      case STRING_TYPE: {
+        uint64_t n;
+        if (!ReadStreamLength(in, compact, n)) {
+          return ESONError(in, "Invalid length");
+        }
+        out.Put('"');
+        while (n > 0) {
+          if ((in.p == in.end) && !in.Fill(1)) {
+            return ESONError(in, "Unexpected end of data");
+          }
+          size_t k = static_cast<size_t>(
+              std::min(n, static_cast<uint64_t>(in.end - in.p)));
+          WriteJSONString(out, in.p, in.p + k);
+          in.p += k;
+          n -= k;
+        }
+        out.Put('"');
+      } break;
+      case BINARY_TYPE:
+      case BINARY_CRC32C_TYPE: {
+        uint64_t n;
+        if (!ReadStreamLength(in, compact, n)) {
+          return ESONError(in, "Invalid length");
+        }
+        if (tag == BINARY_CRC32C_TYPE) {
+          // Skip checksums.
+          uint64_t block_size;
+          if (!ReadStreamLength(in, compact, block_size) ||
+              (block_size == 0) ||
+              !in.Skip(((n + block_size - 1) / block_size) *
+                       sizeof(uint32_t))) {
+            return ESONError(in, "Invalid checksummed binary");
+          }
+        }
+        out.Put('"');
+        while (n > 0) {
+          // Base64 encodes 3 bytes at once.
+          if (!in.Fill(static_cast<size_t>(std::min(n, UINT64_C(3))))) {
+            return ESONError(in, "Unexpected end of data");
+          }
+          uint64_t avail = static_cast<uint64_t>(in.end - in.p);
+          uint64_t k = (n <= avail) ? n : (avail - avail % 3);
+          WriteBase64(out, in.p, static_cast<size_t>(k));
+          in.p += k;
+          n -= k;
+        }
+        out.Put('"');
+      } break;
+      case BINARY_REF_TYPE: {
+        // offset + N. The payload is that of an earlier binary.
+        uint64_t ref_pos = in.Tell();
+        if (!in.Fill(sizeof(int64_t))) {
+          return ESONError(in, "Unexpected end of data");
+        }
+        uint64_t offset, n;
+        memcpy(&offset, in.p, sizeof(int64_t));
+        in.p += sizeof(int64_t);
+        if (!ReadStreamLength(in, compact, n)) {
+          return ESONError(in, "Invalid length");
+        }
+        uint64_t limit = ref_pos - begin;
+        if ((offset > limit) || (n > limit - offset)) {
+          return ESONError(in, "Invalid binary reference");
+        }
+        out.Put('"');
+        if (!WriteBase64At(in, begin + offset, n, out)) {
+          return ESONError(in, "Failed to read referenced binary");
+        }
+        out.Put('"');
+      } break;
+      case OBJECT_TYPE:
+      case ARRAY_TYPE: {
+        OpenContainer c;
+        uint64_t header_pos = in.Tell();
+        uint64_t n;
+        if (!ReadStreamLength(in, compact, n)) {
+          return ESONError(in, "Invalid length");
+        }
+        // Fixed encoding has the total size, compact the size of content.
+        c.end = compact ? in.Tell() + n : header_pos + n;
+        if ((!compact && (n < sizeof(int64_t))) || (c.end > top.end)) {
+          return ESONError(in, "Invalid size");
+        }
+        c.array = (tag == ARRAY_TYPE);
+        c.first = true;
+        out.Put(c.array ? '[' : '{');
+        stack.push_back(c);
+      } break;
+      case COLUMNS_TYPE: {
+        // Rows take values from all columns. They are read in batches.
+        uint64_t header_pos = in.Tell();
+        uint64_t n;
+        if (!ReadStreamLength(in, compact, n)) {
+          return ESONError(in, "Invalid length");
+        }
+        uint64_t content_end = compact ? in.Tell() + n : header_pos + n;
+        if ((!compact && (n < sizeof(int64_t))) || (content_end > top.end)) {
+          return ESONError(in, "Invalid size");
+        }
+        const char *err = WriteJSONColumns(in, out, content_end);
+        if (err) return ESONError(in, err);
+      } break;
+      default:
+        return ESONError(in, "Unknown element type");
+    }
+
+    if (out.failed) return "Failed to write.\n";
   }
 
-  return err.str();
+  return "";
+}
+
+std::string ESONToJSON(FILE *in, FILE *out) {
+  InputStream input(in);
+  OutputStream output(out, NULL);
+  std::string err = ConvertESON(input, output);
+  output.Flush();
+  if (err.empty() && output.failed) err = "Failed to write.\n";
+  return err;
+}
+
+std::string ESONToJSON(const uint8_t *p, uint64_t size, std::string &out) {
+  InputStream input(p, size);
+  OutputStream output(NULL, &out);
+  out.clear();
+  std::string err = ConvertESON(input, output);
+  output.Flush();
+  return err;
 }
 
 }  // namespace eson
@@ -14,20 +14,15 @@ main(
     exit(1);
   }
 
-  // @todo { Use mmap() }
-  std::vector<uint8_t> buf;
-
-  FILE* fp = fopen(argv[1], "rb");
-  fseek(fp, 0, SEEK_END);
-  size_t len = ftell(fp);
-  rewind(fp);
-  buf.resize(len);
-  len = fread(&buf[0], 1, len, fp);
-  fclose(fp);
+  eson::ESON file;
+  if (!file.Load(argv[1])) {
+    printf("Failed to load %s\n", argv[1]);
+    exit(1);
+  }
 
   eson::Value v;
 
-  std::string err = eson::Parse(v, &buf[0]);
+  std::string err = file.Parse(v);
   if (!err.empty()) {
     std::cout << "Err: " << err << std::endl;
     exit(1);
@@ -44,6 +39,10 @@ main(
   eson::Binary faces_data = v.Get("faces").Get<eson::Binary>();
   const int* faces = reinterpret_cast<int*>(const_cast<uint8_t*>(faces_data.ptr));
 
+  // Both arrays are read front to back.
+  file.Advise(vertices_data, eson::ACCESS_SEQUENTIAL);
+  file.Advise(faces_data, eson::ACCESS_SEQUENTIAL);
+
   for (int64_t i = 0; i < num_vertices; i++) {
     printf("  vtx[%lld] = %f, %f, %f\n", i, vertices[3*i+0], vertices[3*i+1], vertices[3*i+2]);
   }
@@ -0,0 +1,40 @@
+#include "eson.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+int
+main(
+  int argc,
+  char** argv)
+{
+  if (argc < 2) {
+    printf("Usage: %s input.eson [output.json]\n", argv[0]);
+    printf("  Writes to stdout if output is omitted.\n");
+    exit(1);
+  }
+
+  FILE* in = fopen(argv[1], "rb");
+  if (!in) {
+    std::cerr << "Err: Failed to open " << argv[1] << std::endl;
+    exit(1);
+  }
+
+  FILE* out = (argc > 2) ? fopen(argv[2], "wb") : stdout;
+  if (!out) {
+    std::cerr << "Err: Failed to open " << argv[2] << std::endl;
+    exit(1);
+  }
+
+  std::string err = eson::ESONToJSON(in, out);
+  fclose(in);
+  if (out != stdout) fclose(out);
+
+  if (!err.empty()) {
+    std::cerr << "Err: " << err << std::endl;
+    exit(1);
+  }
+
+  return 0;
+}
@@ -0,0 +1,41 @@
+#include "eson.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+int
+main(
+  int argc,
+  char** argv)
+{
+  if (argc < 3) {
+    printf("Usage: %s input.json output.eson\n", argv[0]);
+    printf("  Use - for stdin.\n");
+    exit(1);
+  }
+
+  FILE* in = (std::string(argv[1]) == "-") ? stdin : fopen(argv[1], "rb");
+  if (!in) {
+    std::cout << "Err: Failed to open " << argv[1] << std::endl;
+    exit(1);
+  }
+
+  // Must be seekable to write back object sizes.
+  FILE* out = fopen(argv[2], "wb");
+  if (!out) {
+    std::cout << "Err: Failed to open " << argv[2] << std::endl;
+    exit(1);
+  }
+
+  std::string err = eson::JSONToESON(in, out);
+  fclose(out);
+  if (in != stdin) fclose(in);
+
+  if (!err.empty()) {
+    std::cout << "Err: " << err << std::endl;
+    exit(1);
+  }
+
+  return 0;
+}
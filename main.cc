@@ -1,9 +1,16 @@
 #define ESON_IMPLEMENTATION
 #include "eson.h"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 static void
 ESONTest()
@@ -84,6 +91,1122 @@ ESONTest()
   delete [] buf;
 }
 
+struct Material {
+  std::string name;
+  double roughness;
+};
+
+struct Mesh {
+  int64_t num_vertices;
+  eson::Binary vertices;
+  Material material;
+  bool visible;
+  char pad7[7];
+};
+
+ESON_FIELDS_BEGIN(Material)
+  ESON_FIELD(name)
+  ESON_FIELD(roughness)
+ESON_FIELDS_END()
+
+ESON_FIELDS_BEGIN(Mesh)
+  ESON_FIELD(num_vertices)
+  ESON_FIELD(visible)
+  ESON_FIELD(vertices)
+  ESON_FIELD(material)
+ESON_FIELDS_END()
+
+static void
+ESONStructTest()
+{
+  float vertices[9] = {0, 0, 0, 1, 0, 0, 0, 1, 0};
+
+  Mesh mesh;
+  mesh.num_vertices = 3;
+  mesh.visible = true;
+  mesh.vertices.ptr = reinterpret_cast<const uint8_t*>(vertices);
+  mesh.vertices.size = sizeof(vertices);
+  mesh.material.name = "diffuse";
+  mesh.material.roughness = 0.5;
+
+  std::vector<uint8_t> buf(size_t(eson::StructSize(mesh)));
+  uint8_t* end = eson::SerializeStruct(mesh, &buf[0]);
+  assert(end == &buf[0] + buf.size());
+  (void)end;
+
+  // Readable as an ordinary document.
+  eson::Value v;
+  std::string err = eson::Parse(v, &buf[0]);
+  assert(err.empty());
+  assert(v.Get("num_vertices").Get<int64_t>() == 3);
+  assert(v.Get("visible").Get<bool>() == true);
+  assert(v.Get("material").Get("name").Get<std::string>() == "diffuse");
+  assert(v.Get("material").Get("roughness").Get<double>() == 0.5);
+
+  Mesh ret;
+  ret.num_vertices = 0;
+  ret.visible = false;
+  ret.material.roughness = 0.0;
+  err = eson::ParseStruct(ret, &buf[0]);
+  assert(err.empty());
+  assert(ret.num_vertices == 3);
+  assert(ret.visible);
+  assert(ret.vertices.ptr > &buf[0] && ret.vertices.ptr < &buf[0] + buf.size());
+  assert(ret.vertices.size == sizeof(vertices));
+  assert(memcmp(ret.vertices.ptr, vertices, sizeof(vertices)) == 0);
+  assert(ret.material.name == "diffuse");
+  assert(ret.material.roughness == 0.5);
+
+  // Keys are sorted when written through Value.
+  int64_t sz = static_cast<int64_t>(v.Size());
+  std::vector<uint8_t> buf2(static_cast<size_t>(sz));
+  v.Serialize(&buf2[0]);
+  Mesh ret2;
+  err = eson::ParseStruct(ret2, &buf2[0]);
+  assert(err.empty());
+  assert(ret2.num_vertices == 3);
+  assert(ret2.material.name == "diffuse");
+  assert(ret2.vertices.size == sizeof(vertices));
+
+  // Sized overload rejects truncated data.
+  err = eson::ParseStruct(ret2, &buf2[0], buf2.size());
+  assert(err.empty());
+  err = eson::ParseStruct(ret2, &buf2[0], buf2.size() - 1);
+  assert(!err.empty());
+  err = eson::ParseStruct(ret2, &buf2[0], 4);
+  assert(!err.empty());
+
+  // A negative length can't move the key search backwards.
+  eson::Object extra;
+  extra["a"] = eson::Value(std::string("skipped"));
+  extra["num_vertices"] = eson::Value(static_cast<int64_t>(3));
+  eson::Value ev(extra);
+  std::vector<uint8_t> buf3(static_cast<size_t>(ev.Size()));
+  ev.Serialize(&buf3[0]);
+  err = eson::ParseStruct(ret2, &buf3[0], buf3.size());
+  assert(err.empty());
+  int64_t bad = -64;
+  memcpy(&buf3[0] + sizeof(int64_t) + 1 + 2, &bad, sizeof(int64_t));  // "a"
+  err = eson::ParseStruct(ret2, &buf3[0], buf3.size());
+  assert(!err.empty());
+
+  printf("struct test ok\n");
+}
+
+static void
+ESONLoadTest()
+{
+  eson::ESON file;
+  eson::LoadOption option;
+  option.access = eson::ACCESS_RANDOM;
+  bool ok = file.Load("output.eson", option);
+  assert(ok);
+  (void)ok;
+
+  eson::Value ret;
+  std::string err = file.Parse(ret);
+  assert(err.empty());
+
+  eson::Binary bin = ret.Get("bin").Get<eson::Binary>();
+  assert(bin.size == 12);
+  assert(bin.ptr >= file.Data() && bin.ptr < file.Data() + file.Size());
+
+  ok = file.Advise(bin, eson::ACCESS_SEQUENTIAL);
+  assert(ok);
+
+  // Lengths which would wrap around the address space are out of range.
+  ok = file.Advise(bin.ptr, ~static_cast<uint64_t>(0), eson::ACCESS_RANDOM);
+  assert(!ok);
+  ok = file.Advise(file.Data() + file.Size(), 1, eson::ACCESS_RANDOM);
+  assert(!ok);
+
+  std::vector<eson::Binary> ranges;
+  ranges.push_back(bin);
+  ok = file.Prefetch(ranges);
+  assert(ok);
+  file.WaitPrefetch();
+
+  std::vector<eson::Binary> huge(1, bin);
+  huge[0].size = std::numeric_limits<int64_t>::max();
+  ok = file.Prefetch(huge);
+  assert(!ok);
+
+  // Huge page backed copy of the file.
+  eson::ESON hot;
+  option = eson::LoadOption();
+  option.populate = true;
+  option.huge_pages = true;
+  ok = hot.Load("output.eson", option);
+  assert(ok);
+  assert(hot.Size() == file.Size());
+  assert(memcmp(hot.Data(), file.Data(), size_t(file.Size())) == 0);
+
+  printf("load test ok\n");
+}
+
+static void
+ESONChecksumTest()
+{
+  assert(eson::CRC32C(0, reinterpret_cast<const uint8_t*>("123456789"), 9) ==
+         0xe3069283);
+
+  std::vector<uint8_t> payload(1000);
+  for (size_t j = 0; j < payload.size(); j++) {
+    payload[j] = static_cast<uint8_t>(j * 7);
+  }
+
+  eson::Value bval(&payload[0], payload.size());
+  bval.EnableChecksum(256);
+
+  eson::Object subO;
+  subO["muda"] = eson::Value(3.4);
+  subO["name"] = eson::Value(std::string("jojo"));
+  eson::Value sub(subO);
+  sub.EnableChecksum();
+
+  eson::Object o;
+  o["bin"] = bval;
+  o["sub"] = sub;
+  o["dora"] = eson::Value(static_cast<int64_t>(144));
+  eson::Value v(o);
+  v.EnableChecksum();
+
+  std::vector<uint8_t> buf(static_cast<size_t>(v.Size()));
+  uint8_t* end = v.Serialize(&buf[0]);
+  assert(end == &buf[0] + buf.size());
+  (void)end;
+
+  eson::Value ret;
+  std::string err = eson::Parse(ret, &buf[0]);
+  assert(err.empty());
+  assert(ret.HasChecksum());
+  assert(ret.Get("sub").HasChecksum());
+  assert(ret.Get("sub").Get("name").Get<std::string>() == "jojo");
+  eson::Binary bin = ret.Get("bin").Get<eson::Binary>();
+  assert(bin.size == 1000);
+  assert(memcmp(bin.ptr, &payload[0], payload.size()) == 0);
+
+  // Flip a bit in the 3rd block of the binary.
+  size_t offset = static_cast<size_t>(bin.ptr - &buf[0]) + 600;
+  buf[offset] ^= 0x10;
+
+  // By default only blocks touched by a ranged read are verified.
+  err = eson::Parse(ret, &buf[0]);
+  assert(err.empty());
+  assert(ret.Get("bin").VerifyChecksum(0, 512));
+  assert(!ret.Get("bin").VerifyChecksum(500, 100));
+
+  // Eager verification reads all blocks while parsing.
+  eson::ParseOption option;
+  option.verify_binary_checksum = true;
+  err = eson::Parse(ret, &buf[0], buf.size(), option);
+  assert(!err.empty());
+  buf[offset] ^= 0x10;
+  err = eson::Parse(ret, &buf[0], buf.size(), option);
+  assert(err.empty());
+
+  // Flip a bit in the string.
+  uint8_t* name = std::search(&buf[0], &buf[0] + buf.size(),
+                              reinterpret_cast<const uint8_t*>("jojo"),
+                              reinterpret_cast<const uint8_t*>("jojo") + 4);
+  name[1] ^= 0x1;
+  err = eson::Parse(ret, &buf[0]);
+  assert(!err.empty());
+  name[1] ^= 0x1;
+
+  // Broken length prefix is reported, not followed.
+  int64_t broken = 1 << 30;
+  memcpy(name - sizeof(int64_t), &broken, sizeof(int64_t));
+  err = eson::Parse(ret, &buf[0]);
+  assert(!err.empty());
+
+  // A length whose block table and data add up past int64 is rejected.
+  // With a block size of 1, the old signed sum was 5 * n(mod 2^64), chosen
+  // here to land exactly on the end of the document.
+  eson::Object bo;
+  bo["bin"] = bval;
+  bo["zzzzz"] = eson::Value();  // Pads the tail to 3(mod 5) bytes
+  eson::Value bdoc(bo);
+  std::vector<uint8_t> bbuf(static_cast<size_t>(bdoc.Size()));
+  bdoc.Serialize(&bbuf[0]);
+  err = eson::Parse(ret, &bbuf[0]);
+  assert(err.empty());
+  const uint8_t* table = ret.Get("bin").Get<eson::Binary>().ptr - 4 * sizeof(uint32_t);
+  size_t header = static_cast<size_t>(table - &bbuf[0]) - 2 * sizeof(int64_t);
+  uint64_t tail = bbuf.size() - static_cast<size_t>(table - &bbuf[0]);
+  assert(tail % 5 == 3);
+  int64_t huge = static_cast<int64_t>(UINT64_C(0x6666666666666668) + (tail - 8) / 5);
+  int64_t one = 1;
+  memcpy(&bbuf[header], &huge, sizeof(int64_t));
+  memcpy(&bbuf[header + sizeof(int64_t)], &one, sizeof(int64_t));
+  err = eson::Parse(ret, &bbuf[0]);
+  assert(!err.empty());
+
+  printf("checksum test ok\n");
+}
+
+static void
+ESONCompactTest()
+{
+  const int64_t ints[] = {0, 1, -1, 63, -64, 64, 127, 128, 300, -300,
+                          static_cast<int64_t>(1) << 40,
+                          -(static_cast<int64_t>(1) << 55),
+                          static_cast<int64_t>(1) << 56,
+                          INT64_MAX, INT64_MIN};
+  const size_t num_ints = sizeof(ints) / sizeof(ints[0]);
+
+  eson::Object o;
+  for (size_t j = 0; j < num_ints; j++) {
+    char key[16];
+    snprintf(key, sizeof(key), "i%02d", static_cast<int>(j));
+    o[key] = eson::Value(ints[j]);
+  }
+  o["name"] = eson::Value(std::string("jojo"));
+  o["pi"] = eson::Value(3.14);
+  o["flag"] = eson::Value(true);
+
+  std::vector<uint8_t> payload(300, 0xab);
+  eson::Value bval(&payload[0], payload.size());
+  bval.EnableChecksum(128);
+  o["bin"] = bval;
+
+  eson::Object subO;
+  subO["muda"] = eson::Value(static_cast<int64_t>(7));
+  subO["text"] = eson::Value(std::string(200, 'x'));
+  eson::Value sub(subO);
+  sub.EnableChecksum();
+  o["sub"] = sub;
+
+  eson::Value v(o);
+  v.EnableChecksum();
+
+  eson::SerializeOption option;
+  option.encoding = eson::ENCODING_COMPACT;
+  std::vector<uint8_t> buf(static_cast<size_t>(v.Size(option)));
+  uint8_t* end = v.Serialize(&buf[0], option);
+  assert(end == &buf[0] + buf.size());
+  (void)end;
+  assert(buf.size() < v.Size());
+
+  eson::Value ret;
+  std::string err = eson::Parse(ret, &buf[0], buf.size(), eson::ParseOption());
+  assert(err.empty());
+  for (size_t j = 0; j < num_ints; j++) {
+    char key[16];
+    snprintf(key, sizeof(key), "i%02d", static_cast<int>(j));
+    assert(ret.Get(key).Get<int64_t>() == ints[j]);
+  }
+  assert(ret.Get("name").Get<std::string>() == "jojo");
+  assert(ret.Get("pi").Get<double>() == 3.14);
+  assert(ret.Get("flag").Get<bool>());
+  assert(ret.Get("bin").Get<eson::Binary>().size == 300);
+  assert(ret.Get("sub").Get("muda").Get<int64_t>() == 7);
+  assert(ret.Get("sub").Get("text").Get<std::string>().size() == 200);
+
+  // Corruption is still detected.
+  buf[buf.size() - 3] ^= 0x1;
+  err = eson::Parse(ret, &buf[0]);
+  assert(!err.empty());
+
+  printf("compact test ok (%d bytes, fixed %d bytes)\n",
+         static_cast<int>(buf.size()), static_cast<int>(v.Size()));
+}
+
+static void
+ESONIncrementalTest()
+{
+  std::vector<uint8_t> payload(4096, 0x5a);
+
+  eson::Object nodes;
+  for (int j = 0; j < 8; j++) {
+    eson::Object node;
+    node["id"] = eson::Value(static_cast<int64_t>(j));
+    node["mesh"] = eson::Value(&payload[0], payload.size());
+    char key[16];
+    snprintf(key, sizeof(key), "node%d", j);
+    nodes[key] = eson::Value(node);
+  }
+  eson::Object o;
+  o["nodes"] = eson::Value(nodes);
+  o["version"] = eson::Value(static_cast<int64_t>(1));
+  eson::Value v(o);
+
+  std::vector<uint8_t> src(static_cast<size_t>(v.Size()));
+  v.Serialize(&src[0]);
+
+  eson::ParseOption keep;
+  keep.keep_source = true;
+  eson::Value doc;
+  std::string err = eson::Parse(doc, &src[0], src.size(), keep);
+  assert(err.empty());
+  assert(!doc.IsModified());
+  assert(doc.Size() == src.size());
+
+  // Re-save without edits is a copy of the source.
+  std::vector<uint8_t> dst(static_cast<size_t>(doc.Size()));
+  uint8_t* end = doc.Serialize(&dst[0]);
+  assert(end == &dst[0] + dst.size());
+  assert(dst == src);
+
+  // Edit one node. Only the path to it is re-encoded.
+  eson::Object& root = doc.Get<eson::Object>();
+  eson::Object& edited = root["nodes"].Get<eson::Object>();
+  edited["node3"].Get<eson::Object>()["id"] = eson::Value(static_cast<int64_t>(33));
+  edited["node3"].Get<eson::Object>()["name"] = eson::Value(std::string("edited"));
+  assert(doc.IsModified());
+  assert(root["nodes"].IsModified());
+  assert(edited["node3"].IsModified());
+  assert(!edited["node2"].IsModified());
+
+  dst.resize(static_cast<size_t>(doc.Size()));
+  end = doc.Serialize(&dst[0]);
+  assert(end == &dst[0] + dst.size());
+  (void)end;
+
+  eson::Value ret;
+  err = eson::Parse(ret, &dst[0]);
+  assert(err.empty());
+  assert(ret.Get("nodes").Get("node3").Get("id").Get<int64_t>() == 33);
+  assert(ret.Get("nodes").Get("node3").Get("name").Get<std::string>() == "edited");
+  assert(ret.Get("nodes").Get("node5").Get("id").Get<int64_t>() == 5);
+  assert(ret.Get("version").Get<int64_t>() == 1);
+
+  // Same for compact encoding.
+  eson::SerializeOption option;
+  option.encoding = eson::ENCODING_COMPACT;
+  src.resize(static_cast<size_t>(v.Size(option)));
+  v.Serialize(&src[0], option);
+  err = eson::Parse(doc, &src[0], src.size(), keep);
+  assert(err.empty());
+  dst.resize(static_cast<size_t>(doc.Size(option)));
+  doc.Serialize(&dst[0], option);
+  assert(dst == src);
+
+  // Without keep_source the input can be reused before re-saving.
+  eson::Object inner;
+  inner["name"] = eson::Value(std::string("hello"));
+  eson::Object points;
+  eson::Array rows;
+  for (int j = 0; j < 4; j++) {
+    eson::Object row;
+    row["x"] = eson::Value(static_cast<int64_t>(j));
+    rows.push_back(eson::Value(row));
+  }
+  eson::Object o2;
+  o2["inner"] = eson::Value(inner);
+  o2["rows"] = eson::Value(rows);
+  o2["rows"].SetColumnar(true);
+  eson::Value v2(o2);
+  src.resize(static_cast<size_t>(v2.Size()));
+  v2.Serialize(&src[0]);
+  std::vector<uint8_t> expected(src);
+
+  err = eson::Parse(doc, &src[0]);
+  assert(err.empty());
+  assert(doc.IsModified());
+  std::fill(src.begin(), src.end(), 0xcc);
+  assert(doc.Get("inner").Get("name").Get<std::string>() == "hello");
+  dst.resize(static_cast<size_t>(doc.Size()));
+  doc.Serialize(&dst[0]);
+  assert(dst == expected);
+
+  printf("incremental test ok\n");
+}
+
+static void
+ESONSharedTest()
+{
+  eson::Object subO;
+  subO["name"] = eson::Value(std::string("jojo"));
+  subO["muda"] = eson::Value(3.4);
+
+  eson::Object o;
+  o["sub"] = eson::Value(subO);
+  eson::Value v(o);
+
+  // Copies share data.
+  eson::Value sub = v.Get("sub");
+  const eson::Value& csub = sub;
+  assert(&csub.Get<eson::Object>() == &v.Get("sub").Get<eson::Object>());
+
+  // Modification copies it first.
+  sub.Get<eson::Object>()["name"] = eson::Value(std::string("dio"));
+  assert(sub.Get("name").Get<std::string>() == "dio");
+  assert(v.Get("sub").Get("name").Get<std::string>() == "jojo");
+
+  // Data handed out for modification is not shared anymore.
+  eson::Object& obj = sub.Get<eson::Object>();
+  eson::Value copy = sub;
+  obj["name"] = eson::Value(std::string("jotaro"));
+  assert(copy.Get("name").Get<std::string>() == "dio");
+
+  printf("shared test ok\n");
+}
+
+static void
+ESONBufferTest()
+{
+  uint8_t bindata[12];
+  for (int j = 0; j < 12; j++) {
+    bindata[j] = static_cast<uint8_t>(j);
+  }
+
+  eson::Object subO;
+  subO["muda"] = eson::Value(3.4);
+
+  eson::Object o;
+  o["bin"] = eson::Value(eson::Buffer::Copy(bindata, 12));  // Owned copy.
+  o["sub"] = eson::Value(subO);
+  eson::Value v(o);
+
+  eson::Buffer buffer = eson::Buffer::Allocate(v.Size());
+  v.Serialize(buffer.Data());
+
+  // Values hold the buffer after the caller drops it.
+  eson::Value ret;
+  std::string err = eson::Parse(ret, buffer);
+  assert(err.empty());
+  assert(buffer.UseCount() > 1);
+  buffer = eson::Buffer();
+
+  eson::Binary bin = ret.Get("bin").Get<eson::Binary>();
+  assert(bin.size == 12);
+  assert(memcmp(bin.ptr, bindata, 12) == 0);
+
+  std::vector<uint8_t> out(ret.Size());
+  ret.Serialize(&out[0]);  // Copies source bytes of "sub".
+
+  // Mapping stays alive after the loader is destroyed.
+  {
+    eson::ESON file;
+    bool ok = file.Load("output.eson");
+    assert(ok);
+    (void)ok;
+    err = file.Parse(ret);
+    assert(err.empty());
+  }
+  bin = ret.Get("bin").Get<eson::Binary>();
+  assert(bin.size == 12);
+  assert(memcmp(bin.ptr, bindata, 12) == 0);
+
+  // Pointers past the end are outside the buffer, even for empty ranges.
+  buffer = eson::Buffer::Wrap(bindata, 8, NULL, NULL);
+  assert(buffer.Contains(bindata + 8, 0));
+  assert(!buffer.Contains(bindata + 8, 1));
+  assert(!buffer.Contains(bindata + 10, 0));
+
+  printf("buffer test ok\n");
+}
+
+#ifndef _WIN32
+struct FrozenWork {
+  const eson::Value* doc;
+  const std::vector<uint8_t>* expected;
+  bool ok;
+  char pad7[7];
+};
+
+static void*
+FrozenReader(void* arg)
+{
+  FrozenWork* work = reinterpret_cast<FrozenWork*>(arg);
+  const eson::Value& doc = *work->doc;
+  work->ok = true;
+  for (int i = 0; i < 100; i++) {
+    if (doc.Size() != work->expected->size()) work->ok = false;
+    if (doc.Get("sub").Size() == 0) work->ok = false;
+    if (doc.Get("sub").Get("muda").Get<double>() != 3.4) work->ok = false;
+    if (doc.Get("missing").Type() != eson::NULL_TYPE) work->ok = false;
+
+    // Copies may be modified.
+    eson::Value sub = doc.Get("sub");
+    sub.Get<eson::Object>()["muda"] = eson::Value(static_cast<int64_t>(i));
+
+    std::vector<uint8_t> out(doc.Size());
+    doc.Serialize(&out[0]);
+    if (out != *work->expected) work->ok = false;
+  }
+  return NULL;
+}
+#endif
+
+static void
+ESONFrozenTest()
+{
+#ifndef _WIN32
+  eson::Object subO;
+  subO["muda"] = eson::Value(3.4);
+  subO["name"] = eson::Value(std::string("jojo"));
+
+  eson::Object o;
+  o["sub"] = eson::Value(subO);
+  o["bin"] = eson::Value(eson::Buffer::Copy(
+      reinterpret_cast<const uint8_t*>("dio"), 3));
+  eson::Value v(o);
+
+  eson::Buffer buffer = eson::Buffer::Allocate(v.Size());
+  v.Serialize(buffer.Data());
+
+  eson::Value doc;
+  std::string err = eson::Parse(doc, buffer);
+  assert(err.empty());
+  doc.Get<eson::Object>()["added"] = eson::Value(static_cast<int64_t>(1));
+  doc.Freeze();
+
+  std::vector<uint8_t> expected(doc.Size());
+  doc.Serialize(&expected[0]);
+
+  const int kNumThreads = 4;
+  pthread_t threads[kNumThreads];
+  FrozenWork works[kNumThreads];
+  for (int i = 0; i < kNumThreads; i++) {
+    works[i].doc = &doc;
+    works[i].expected = &expected;
+    pthread_create(&threads[i], NULL, FrozenReader, &works[i]);
+  }
+  for (int i = 0; i < kNumThreads; i++) {
+    pthread_join(threads[i], NULL);
+    assert(works[i].ok);
+  }
+
+  printf("frozen test ok\n");
+#endif
+}
+
+static void
+ESONJSONTest()
+{
+  const char* json =
+      "{\"name\": \"jo\\\"jo\\u00e9\\ud83d\\ude00\", \"id\": -42,\n"
+      " \"big\": 18446744073709551616, \"scale\": 2.5e-3,\n"
+      " \"flags\": [true, false, null], \"empty\": [], \"none\": {},\n"
+      " \"nodes\": [{\"xform\": [1, 0.5, [2]]}, \"leaf\"]}";
+
+  std::vector<uint8_t> buf;
+  std::string err = eson::JSONToESON(json, strlen(json), buf);
+  assert(err.empty());
+
+  eson::Value v;
+  err = eson::Parse(v, &buf[0]);
+  assert(err.empty());
+  assert(v.Get("name").Get<std::string>() ==
+         "jo\"jo\xc3\xa9\xf0\x9f\x98\x80");
+  assert(v.Get("id").Get<int64_t>() == -42);
+  assert(v.Get("big").Get<double>() == 18446744073709551616.0);
+  assert(v.Get("scale").Get<double>() == 2.5e-3);
+  assert(v.Get("flags").ArrayLen() == 3);
+  assert(v.Get("flags").Get(1).Get<bool>() == false);
+  assert(v.Get("flags").Get(2).Type() == eson::NULL_TYPE);
+  assert(v.Get("empty").ArrayLen() == 0);
+  assert(v.Get("none").Keys().empty());
+  const eson::Value& xform = v.Get("nodes").Get(0).Get("xform");
+  assert(xform.Get(0).Get<int64_t>() == 1);
+  assert(xform.Get(1).Get<double>() == 0.5);
+  assert(xform.Get(2).Get(0).Get<int64_t>() == 2);
+  assert(v.Get("nodes").Get(1).Get<std::string>() == "leaf");
+
+  // Arrays written by Value are the same.
+  std::vector<uint8_t> out(v.Size());
+  v.Serialize(&out[0]);
+  eson::Value v2;
+  err = eson::Parse(v2, &out[0]);
+  assert(err.empty());
+  assert(v2.Get("nodes").Get(0).Get("xform").Get(2).Get(0).Get<int64_t>() ==
+         2);
+
+  // Back to JSON, in the original order.
+  std::string text;
+  err = eson::ESONToJSON(&buf[0], buf.size(), text);
+  assert(err.empty());
+  assert(text ==
+         "{\"name\":\"jo\\\"jo\xc3\xa9\xf0\x9f\x98\x80\",\"id\":-42,"
+         "\"big\":1.8446744073709552e+19,\"scale\":0.0025,"
+         "\"flags\":[true,false,null],\"empty\":[],\"none\":{},"
+         "\"nodes\":[{\"xform\":[1,0.5,[2]]},\"leaf\"]}");
+
+  // Binary is base64.
+  eson::Object o;
+  o["bin"] = eson::Value(reinterpret_cast<const uint8_t*>("eson"), 4);
+  out.resize(eson::Value(o).Size());
+  eson::Value(o).Serialize(&out[0]);
+  err = eson::ESONToJSON(&out[0], out.size(), text);
+  assert(err.empty());
+  assert(text == "{\"bin\":\"ZXNvbg==\"}");
+
+  err = eson::JSONToESON("{\"a\": [1, 2}", 12, buf);
+  assert(!err.empty());
+  err = eson::JSONToESON("[1]", 3, buf);
+  assert(!err.empty());
+
+  // Document larger than the writer buffer. Sizes are written back to the
+  // file.
+  FILE* fp = tmpfile();
+  assert(fp);
+  {
+    eson::StreamWriter writer(fp, 4096);
+    writer.BeginObject("");
+    writer.BeginArray("values");
+    for (int64_t i = 0; i < 10000; i++) {
+      writer.Int64("", i);
+    }
+    writer.End();
+    writer.End();
+    err = writer.Finish();
+    assert(err.empty());
+  }
+  rewind(fp);
+  std::vector<uint8_t> file_data(8 + 1 + 7 + 8 + 10000 * 9);
+  size_t n = fread(&file_data[0], 1, file_data.size(), fp);
+  assert(n == file_data.size());
+  (void)n;
+  fclose(fp);
+  err = eson::Parse(v, &file_data[0]);
+  assert(err.empty());
+  assert(v.Get("values").ArrayLen() == 10000);
+  assert(v.Get("values").Get(9999).Get<int64_t>() == 9999);
+
+  printf("json test ok\n");
+}
+
+static void
+ESONColumnsTest()
+{
+  uint8_t blob[4] = {1, 2, 3, 4};
+
+  eson::Array points;
+  for (int j = 0; j < 100; j++) {
+    eson::Object pt;
+    pt["id"] = eson::Value(static_cast<int64_t>(j));
+    pt["x"] = eson::Value(0.5 * j);
+    pt["visible"] = eson::Value((j % 3) == 0);
+    pt["name"] = eson::Value(std::string(static_cast<size_t>(j % 5), 'p'));
+    pt["data"] = eson::Value(blob, static_cast<uint64_t>(j % 4));
+    points.push_back(eson::Value(pt));
+  }
+  eson::Value rows(points);
+  uint64_t row_size = rows.Size();
+
+  eson::Array mixed;
+  mixed.push_back(eson::Value(static_cast<int64_t>(1)));
+  mixed.push_back(eson::Value(std::string("two")));
+
+  eson::Object o;
+  o["points"] = eson::Value(points);
+  o["points"].SetColumnar(true);
+  o["mixed"] = eson::Value(mixed);
+  o["mixed"].SetColumnar(true);  // Not same-schema objects. Stays an array.
+  eson::Value v(o);
+  assert(o["points"].Size() < row_size);
+
+  std::vector<uint8_t> buf(static_cast<size_t>(v.Size()));
+  uint8_t* end = v.Serialize(&buf[0]);
+  assert(end == &buf[0] + buf.size());
+  (void)end;
+
+  // Keep the source so that rows are decoded lazily.
+  eson::ParseOption keep;
+  keep.keep_source = true;
+  eson::Value doc;
+  std::string err = eson::Parse(doc, &buf[0], buf.size(), keep);
+  assert(err.empty());
+  const eson::Value& pts = doc.Get("points");
+  assert(pts.IsArray());
+  assert(pts.IsColumnar());
+
+  // Columns are read in place.
+  eson::Column x;
+  assert(pts.GetColumn("x", x));
+  assert(x.type == eson::FLOAT64_TYPE);
+  assert(x.rows == 100);
+  assert((x.data > &buf[0]) && (x.data < &buf[0] + buf.size()));
+  double sum = 0.0;
+  for (uint64_t i = 0; i < x.rows; i++) {
+    sum += x.Float64(i);
+  }
+  assert(sum == 0.5 * 4950);
+  eson::Column name;
+  assert(pts.GetColumn("name", name));
+  uint64_t n;
+  name.Bytes(7, n);
+  assert(n == 2);
+  assert(!pts.GetColumn("missing", x));
+  assert(!doc.Get("mixed").GetColumn("x", x));
+  assert(pts.ArrayLen() == 100);
+
+  // Rows through the Value API.
+  assert(pts.Get(7).Get("id").Get<int64_t>() == 7);
+  assert(pts.Get(9).Get("visible").Get<bool>());
+  assert(pts.Get(9).Get("name").Get<std::string>() == "pppp");
+  assert(pts.Get(3).Get("data").Get<eson::Binary>().size == 3);
+  assert(pts.Get(3).Get("data").Get<eson::Binary>().ptr[2] == 3);
+  assert(doc.Get("mixed").Get(1).Get<std::string>() == "two");
+
+  // Unmodified columns are copied as is.
+  std::vector<uint8_t> dst(static_cast<size_t>(doc.Size()));
+  doc.Serialize(&dst[0]);
+  assert(dst == buf);
+
+  // Edit a row. The array is encoded again from rows.
+  eson::Array& edited = doc.Get<eson::Object>()["points"].Get<eson::Array>();
+  edited[5].Get<eson::Object>()["id"] = eson::Value(static_cast<int64_t>(-5));
+  assert(!doc.Get("points").GetColumn("id", x));
+  dst.resize(static_cast<size_t>(doc.Size()));
+  doc.Serialize(&dst[0]);
+  eson::Value ret;
+  err = eson::Parse(ret, &dst[0]);
+  assert(err.empty());
+  eson::Column id;
+  assert(ret.Get("points").GetColumn("id", id));
+  assert(id.Int64(5) == -5);
+  assert(id.Int64(6) == 6);
+
+  // A row of another schema turns it back into an array.
+  eson::Array& again = doc.Get<eson::Object>()["points"].Get<eson::Array>();
+  again[6].Get<eson::Object>()["extra"] = eson::Value(true);
+  dst.resize(static_cast<size_t>(doc.Size()));
+  doc.Serialize(&dst[0]);
+  err = eson::Parse(ret, &dst[0]);
+  assert(err.empty());
+  assert(!ret.Get("points").IsColumnar());
+  assert(ret.Get("points").Get(6).Get("extra").Get<bool>());
+
+  // Compact encoding has the same columns.
+  eson::SerializeOption option;
+  option.encoding = eson::ENCODING_COMPACT;
+  dst.resize(static_cast<size_t>(v.Size(option)));
+  end = v.Serialize(&dst[0], option);
+  assert(end == &dst[0] + dst.size());
+  err = eson::Parse(ret, &dst[0]);
+  assert(err.empty());
+  assert(ret.Get("points").GetColumn("x", x));
+  assert(x.Float64(99) == 49.5);
+  assert(ret.Get("points").Get(99).Get("id").Get<int64_t>() == 99);
+
+  // JSON has rows.
+  std::string columnar_json, row_json;
+  err = eson::ESONToJSON(&buf[0], buf.size(), columnar_json);
+  assert(err.empty());
+  o["points"].SetColumnar(false);
+  dst.resize(static_cast<size_t>(eson::Value(o).Size()));
+  eson::Value(o).Serialize(&dst[0]);
+  err = eson::ESONToJSON(&dst[0], dst.size(), row_json);
+  assert(err.empty());
+  assert(columnar_json == row_json);
+
+  // Columns without fields would not bound the number of rows.
+  eson::Array empties(3, eson::Value(eson::Object()));
+  eson::Value ev(empties);
+  ev.SetColumnar(true);
+  eson::Object eo;
+  eo["e"] = ev;
+  eson::Value edoc(eo);
+  dst.resize(static_cast<size_t>(edoc.Size()));
+  edoc.Serialize(&dst[0]);
+  err = eson::Parse(ret, &dst[0]);
+  assert(err.empty());
+  assert(!ret.Get("e").IsColumnar());
+  assert(ret.Get("e").ArrayLen() == 3);
+
+  uint8_t fake[35];
+  int64_t fake_size = sizeof(fake);
+  int64_t fake_columns = 8 + 16;
+  int64_t fake_rows = (static_cast<int64_t>(1) << 56) - 1;
+  int64_t fake_fields = 0;
+  memcpy(fake, &fake_size, 8);
+  fake[8] = eson::COLUMNS_TYPE;
+  fake[9] = 'c';
+  fake[10] = '\0';
+  memcpy(fake + 11, &fake_columns, 8);
+  memcpy(fake + 19, &fake_rows, 8);
+  memcpy(fake + 27, &fake_fields, 8);
+  err = eson::Parse(ret, fake, sizeof(fake), eson::ParseOption());
+  assert(!err.empty());
+  eson::ParseOption keep_fake;
+  keep_fake.keep_source = true;
+  err = eson::Parse(ret, fake, sizeof(fake), keep_fake);
+  assert(!err.empty());
+  err = eson::ESONToJSON(fake, sizeof(fake), row_json);
+  assert(!err.empty());
+
+  // Columns larger than a conversion batch are streamed from a file.
+  eson::Array big;
+  for (int j = 0; j < 40; j++) {
+    eson::Object row;
+    row["id"] = eson::Value(static_cast<int64_t>(j));
+    row["text"] = eson::Value(std::string(1024 * 1024, static_cast<char>('a' + j % 26)));
+    big.push_back(eson::Value(row));
+  }
+  eson::Object bo;
+  bo["big"] = eson::Value(big);
+  bo["tail"] = eson::Value(true);
+  dst.resize(static_cast<size_t>(eson::Value(bo).Size()));
+  eson::Value(bo).Serialize(&dst[0]);
+  err = eson::ESONToJSON(&dst[0], dst.size(), row_json);
+  assert(err.empty());
+  bo["big"].SetColumnar(true);
+  for (int mode = 0; mode < 2; mode++) {
+    if (mode == 1) {
+      // A row which doesn't fit in a batch is an error.
+      bo["big"].Get<eson::Array>()[3].Get<eson::Object>()["text"] =
+          eson::Value(std::string(17 * 1024 * 1024, 'x'));
+    }
+    eson::Value bv(bo);
+    assert(bv.Get("big").IsColumnar());
+    dst.resize(static_cast<size_t>(bv.Size()));
+    bv.Serialize(&dst[0]);
+    FILE* fp = fopen("output.eson", "wb");
+    assert(fp);
+    fwrite(&dst[0], 1, dst.size(), fp);
+    fclose(fp);
+
+    FILE* in = fopen("output.eson", "rb");
+    FILE* tmp = tmpfile();
+    assert(in && tmp);
+    err = eson::ESONToJSON(in, tmp);
+    fclose(in);
+    if (mode == 1) {
+      assert(!err.empty());
+      fclose(tmp);
+      break;
+    }
+    assert(err.empty());
+    std::string file_json(row_json.size() + 1, '\0');
+    rewind(tmp);
+    size_t got = fread(&file_json[0], 1, file_json.size(), tmp);
+    assert(got == row_json.size());
+    (void)got;
+    file_json.resize(row_json.size());
+    assert(file_json == row_json);
+    fclose(tmp);
+  }
+
+  printf("columns test ok\n");
+}
+
+static void
+ESONSaveFileTest()
+{
+  // Larger than several chunks, with objects, checksums and columns spanning
+  // chunk boundaries.
+  std::vector<uint8_t> payload(300000);
+  for (size_t j = 0; j < payload.size(); j++) {
+    payload[j] = static_cast<uint8_t>(j * 7);
+  }
+
+  eson::Object nodes;
+  for (int j = 0; j < 4000; j++) {
+    char key[16];
+    snprintf(key, sizeof(key), "node%d", j);
+    nodes[key] = eson::Value(static_cast<int64_t>(j));
+  }
+  eson::Array points;
+  for (int j = 0; j < 3000; j++) {
+    eson::Object pt;
+    pt["x"] = eson::Value(0.25 * j);
+    pt["name"] = eson::Value(std::string(static_cast<size_t>(j % 17), 'n'));
+    points.push_back(eson::Value(pt));
+  }
+
+  eson::Object o;
+  o["nodes"] = eson::Value(nodes);
+  o["nodes"].EnableChecksum();
+  o["mesh"] = eson::Value(&payload[0], payload.size());
+  o["mesh"].EnableChecksum(4096);
+  o["raw"] = eson::Value(&payload[0], payload.size());
+  o["points"] = eson::Value(points);
+  o["points"].SetColumnar(true);
+  eson::Value v(o);
+  v.EnableChecksum();
+
+  for (int mode = 0; mode < 4; mode++) {
+    eson::SaveOption option;
+    option.buffer_size = 4096;  // Smallest chunk
+    option.direct = (mode & 1) != 0;
+    if (mode & 2) option.serialize.encoding = eson::ENCODING_COMPACT;
+
+    std::vector<uint8_t> expected(
+        static_cast<size_t>(v.Size(option.serialize)));
+    v.Serialize(&expected[0], option.serialize);
+
+    std::string err = eson::SaveFile("output.eson", v, option);
+    assert(err.empty());
+
+    eson::ESON file;
+    bool ok = file.Load("output.eson");
+    assert(ok);
+    (void)ok;
+    assert(file.Size() == expected.size());
+    assert(memcmp(file.Data(), &expected[0], expected.size()) == 0);
+
+    eson::Value ret;
+    err = file.Parse(ret);
+    assert(err.empty());
+    assert(ret.Get("nodes").Get("node3999").Get<int64_t>() == 3999);
+  }
+
+  // Parsed source bytes are copied through chunks too.
+  std::vector<uint8_t> src(static_cast<size_t>(v.Size()));
+  v.Serialize(&src[0]);
+  eson::ParseOption keep;
+  keep.keep_source = true;
+  eson::Value doc;
+  std::string err = eson::Parse(doc, &src[0], src.size(), keep);
+  assert(err.empty());
+  err = eson::SaveFile("output.eson", doc);
+  assert(err.empty());
+  eson::ESON file;
+  bool ok = file.Load("output.eson");
+  assert(ok);
+  (void)ok;
+  assert(file.Size() == src.size());
+  assert(memcmp(file.Data(), &src[0], src.size()) == 0);
+
+  err = eson::SaveFile("no/such/dir/output.eson", doc);
+  assert(!err.empty());
+
+  printf("save file test ok\n");
+}
+
+static void
+ESONDedupTest()
+{
+  std::vector<uint8_t> texture(1500000);  // Larger than a conversion chunk
+  for (size_t j = 0; j < texture.size(); j++) {
+    texture[j] = static_cast<uint8_t>(j * 13);
+  }
+  std::vector<uint8_t> copy(texture);     // Same bytes at another address
+  std::vector<uint8_t> other(texture);
+  other[other.size() - 1] ^= 1;           // Same size, different bytes
+  uint8_t small[16] = {0};
+
+  eson::Array materials;
+  for (int j = 0; j < 3; j++) {
+    eson::Object m;
+    m["texture"] = eson::Value(&copy[0], copy.size());
+    m["small"] = eson::Value(small, sizeof(small));
+    materials.push_back(eson::Value(m));
+  }
+  eson::Object o;
+  o["a"] = eson::Value(&texture[0], texture.size());
+  o["b"] = eson::Value(&other[0], other.size());
+  o["c"] = eson::Value(&texture[0], texture.size());
+  o["materials"] = eson::Value(materials);
+  eson::Value v(o);
+
+  std::string json;
+  std::vector<uint8_t> plain(static_cast<size_t>(v.Size()));
+  v.Serialize(&plain[0]);
+  std::string err = eson::ESONToJSON(&plain[0], plain.size(), json);
+  assert(err.empty());
+
+  for (int mode = 0; mode < 2; mode++) {
+    eson::SerializeOption option;
+    option.dedup_binary = true;
+    if (mode) option.encoding = eson::ENCODING_COMPACT;
+
+    uint64_t sz = v.Size(option);
+    assert(sz < 3 * texture.size());  // `a` and `b` only
+    std::vector<uint8_t> buf(static_cast<size_t>(sz));
+    uint8_t *end = v.Serialize(&buf[0], option);
+    assert(end == &buf[0] + sz);
+    (void)end;
+
+    eson::Value ret;
+    err = eson::Parse(ret, &buf[0], buf.size(), eson::ParseOption());
+    assert(err.empty());
+
+    // References point to the first payload.
+    eson::Binary a = ret.Get("a").Get<eson::Binary>();
+    eson::Binary b = ret.Get("b").Get<eson::Binary>();
+    assert(a.size == static_cast<int64_t>(texture.size()));
+    assert(memcmp(a.ptr, &texture[0], texture.size()) == 0);
+    assert(memcmp(b.ptr, &other[0], other.size()) == 0);
+    assert(ret.Get("c").Get<eson::Binary>().ptr == a.ptr);
+    for (int j = 0; j < 3; j++) {
+      const eson::Value &m = ret.Get("materials").Get(j);
+      assert(m.Get("texture").Get<eson::Binary>().ptr == a.ptr);
+      assert(m.Get("small").Get<eson::Binary>().size == 16);
+    }
+
+    // Saving without deduplication writes every payload again.
+    std::vector<uint8_t> out(static_cast<size_t>(ret.Size()));
+    ret.Serialize(&out[0]);
+    assert(out == plain);
+
+    std::string ret_json;
+    err = eson::ESONToJSON(&buf[0], buf.size(), ret_json);
+    assert(err.empty());
+    assert(ret_json == json);
+
+    // Chunked save gives the same bytes, and file conversion reads
+    // references behind its buffer.
+    eson::SaveOption save;
+    save.buffer_size = 4096;
+    save.serialize = option;
+    err = eson::SaveFile("output.eson", v, save);
+    assert(err.empty());
+    FILE *in = fopen("output.eson", "rb");
+    FILE *tmp = tmpfile();
+    assert(in && tmp);
+    std::vector<uint8_t> saved(buf.size() + 1);
+    size_t n = fread(&saved[0], 1, saved.size(), in);
+    assert(n == buf.size());
+    assert(memcmp(&saved[0], &buf[0], buf.size()) == 0);
+    rewind(in);
+    err = eson::ESONToJSON(in, tmp);
+    assert(err.empty());
+    std::string file_json(json.size() + 1, '\0');
+    rewind(tmp);
+    n = fread(&file_json[0], 1, file_json.size(), tmp);
+    assert(n == json.size());
+    (void)n;
+    file_json.resize(json.size());
+    assert(file_json == json);
+    fclose(in);
+    fclose(tmp);
+  }
+
+  // A reference to bytes after itself is rejected.
+  eson::SerializeOption option;
+  option.dedup_binary = true;
+  std::vector<uint8_t> buf(static_cast<size_t>(v.Size(option)));
+  v.Serialize(&buf[0], option);
+  uint8_t *ref = &buf[0] + sizeof(int64_t) + 1 + 2 + sizeof(int64_t) +
+                 texture.size() + 1 + 2 + sizeof(int64_t) + other.size() +
+                 1 + 2;  // "c"
+  assert(ref[-3] == eson::BINARY_REF_TYPE);
+  int64_t bad = static_cast<int64_t>(buf.size());
+  memcpy(ref, &bad, sizeof(int64_t));
+  eson::Value ret;
+  err = eson::Parse(ret, &buf[0], buf.size(), eson::ParseOption());
+  assert(!err.empty());
+
+  // Many distinct payloads of the same size, e.g. per-instance transforms.
+  std::vector<uint8_t> matrices(20000 * 64);
+  for (size_t j = 0; j < matrices.size(); j++) {
+    matrices[j] = static_cast<uint8_t>((j / 64) >> ((j % 4) * 8));
+  }
+  std::vector<uint8_t> matrix7(&matrices[7 * 64], &matrices[8 * 64]);
+  eson::Array instances;
+  for (size_t j = 0; j < 20000; j++) {
+    instances.push_back(eson::Value(&matrices[j * 64], 64));
+  }
+  instances.push_back(eson::Value(&matrix7[0], 64));
+  eson::Object io;
+  io["instances"] = eson::Value(instances);
+  eson::Value iv(io);
+  assert(iv.Size(option) == iv.Size() - (sizeof(int64_t) + 64) +
+                                2 * sizeof(int64_t));
+  buf.resize(static_cast<size_t>(iv.Size(option)));
+  iv.Serialize(&buf[0], option);
+  err = eson::Parse(ret, &buf[0], buf.size(), eson::ParseOption());
+  assert(err.empty());
+  assert(ret.Get("instances").Get(20000).Get<eson::Binary>().ptr ==
+         ret.Get("instances").Get(7).Get<eson::Binary>().ptr);
+
+  printf("dedup test ok\n");
+}
+
 int
 main(
   int argc,
@@ -93,6 +1216,18 @@ main(
   (void)argv;
   printf("Testing ESON C++ binding...\n");
   ESONTest();
+  ESONLoadTest();
+  ESONStructTest();
+  ESONChecksumTest();
+  ESONCompactTest();
+  ESONIncrementalTest();
+  ESONSharedTest();
+  ESONBufferTest();
+  ESONFrozenTest();
+  ESONJSONTest();
+  ESONColumnsTest();
+  ESONSaveFileTest();
+  ESONDedupTest();
   printf("Test DONE\n");
 
   return EXIT_SUCCESS;